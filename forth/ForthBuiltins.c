@@ -524,6 +524,8 @@ ForthEvalResult builtin_foreach(ForthInterpreter *in)
         ForthObject__list_push_copy(in->stack, el);
         res = ForthInterpreter__eval_every(in, body);
         ForthObject__drop(el);
+        if (res == BudgetExceeded)
+            break;
     }
 
     ForthObject__drop(body);
@@ -577,7 +579,11 @@ ForthEvalResult builtin_while(ForthInterpreter *in)
     ForthEvalResult res = Ok;
     while (true)
     {
-        ForthInterpreter__eval_every(in, condition);
+        if (ForthInterpreter__eval_every(in, condition) == BudgetExceeded)
+        {
+            res = BudgetExceeded;
+            break;
+        }
 
         ForthObject *result = NULL;
         args_res = ForthInterpreter__pop_args(in, 1, &result, Number);
@@ -592,7 +598,13 @@ ForthEvalResult builtin_while(ForthInterpreter *in)
         if (should_break)
             break;
 
-        res |= ForthInterpreter__eval_every(in, body);
+        ForthEvalResult body_res = ForthInterpreter__eval_every(in, body);
+        if (body_res == BudgetExceeded)
+        {
+            res = BudgetExceeded;
+            break;
+        }
+        res |= body_res;
     }
 
     ForthObject__drop(condition);
@@ -612,7 +624,7 @@ ForthEvalResult builtin_times(ForthInterpreter *in)
     ForthObject__drop(times);
 
     ForthEvalResult res = Ok;
-    for (double _ = 0; _ < to_num; _++)
+    for (double _ = 0; _ < to_num && res != BudgetExceeded; _++)
         res = ForthInterpreter__eval_every(in, body);
 
     ForthObject__drop(body);
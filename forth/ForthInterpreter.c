@@ -2,6 +2,7 @@
 #include "ForthObject.h"
 #include "ForthParser.h"
 #include "ForthBuiltins.h"
+#include <time.h>
 
 SymbolsTableEntry *SymbolsTableEntry__new_object(char *key, ForthObject *obj)
 {
@@ -158,6 +159,11 @@ ForthInterpreter *ForthInterpreter__new(bool is_sandboxed)
     self->symbols = SymbolsTable__new();
     self->parser = ForthParser__new();
     self->is_sandboxed = is_sandboxed;
+    self->has_budget = false;
+    self->budget_exceeded = false;
+    self->budget_steps = 0;
+    self->budget_deadline = 0;
+    self->budget_ticks = 0;
     ForthInterpreter__load_builtins(self);
 
     return self;
@@ -216,10 +222,41 @@ ForthObject *ForthInterpreter__resolve_template(ForthInterpreter *self, ForthObj
     return resolved;
 }
 
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// the clock is only read every BUDGET_CLOCK_STEPS evaluations
+#define BUDGET_CLOCK_STEPS 1024
+
+static bool ForthInterpreter__spend_step(ForthInterpreter *self)
+{
+    if (self->budget_exceeded)
+        return false;
+
+    if (self->budget_steps && --self->budget_steps == 0)
+        self->budget_exceeded = true;
+    else if (self->budget_deadline && ++self->budget_ticks % BUDGET_CLOCK_STEPS == 0 &&
+             monotonic_ns() >= self->budget_deadline)
+        self->budget_exceeded = true;
+
+    if (self->budget_exceeded)
+        fprintf(stderr, "BudgetExceeded: evaluation aborted\n");
+
+    return !self->budget_exceeded;
+}
+
 ForthEvalResult ForthInterpreter__eval(ForthInterpreter *self, ForthObject *expr)
 {
     ForthEvalResult res = Ok;
 
+    if (self->has_budget && !ForthInterpreter__spend_step(self))
+        return BudgetExceeded;
+
     switch (expr->type)
     {
     case List:
@@ -275,11 +312,14 @@ ForthEvalResult ForthInterpreter__eval_every(ForthInterpreter *self, ForthObject
     ForthEvalResult res = Ok;
 
     if (expr->type == List)
-        for (size_t i = 0; i < expr->list.len; i++)
+        for (size_t i = 0; i < expr->list.len && !self->budget_exceeded; i++)
             res |= ForthInterpreter__eval(self, expr->list.data[i]);
     else
         res = ForthInterpreter__eval(self, expr);
 
+    if (self->budget_exceeded)
+        res = BudgetExceeded;
+
     if (res != Ok)
     {
         fprintf(stderr, "   while evaluating ");
@@ -290,6 +330,29 @@ ForthEvalResult ForthInterpreter__eval_every(ForthInterpreter *self, ForthObject
     return res;
 }
 
+ForthEvalResult ForthInterpreter__eval_budgeted(ForthInterpreter *self, ForthObject *expr, size_t max_steps, unsigned max_ms)
+{
+    if (self->has_budget)
+        return ForthInterpreter__eval_every(self, expr);
+
+    size_t stack_len = self->stack->list.len;
+    self->has_budget = max_steps || max_ms;
+    self->budget_exceeded = false;
+    self->budget_steps = max_steps;
+    self->budget_deadline = max_ms ? monotonic_ns() + (uint64_t)max_ms * 1000000 : 0;
+
+    ForthEvalResult res = ForthInterpreter__eval_every(self, expr);
+
+    if (res == BudgetExceeded)
+        while (self->stack->list.len > stack_len)
+            ForthObject__drop(ForthObject__list_pop(self->stack));
+
+    self->has_budget = false;
+    self->budget_exceeded = false;
+
+    return res;
+}
+
 ForthEvalResult ForthInterpreter__pop_args(ForthInterpreter *self, size_t n, ...)
 {
     ForthEvalResult res = Ok;
@@ -3,6 +3,7 @@
 
 #include "ForthParser.h"
 #include <stdarg.h>
+#include <stdint.h>
 
 #define SYMBOLS_TABLE_DEFAULT_CAPACITY 20
 
@@ -20,7 +21,8 @@ typedef enum ForthEvalResult {
     ParsingError,
     IndexError,
     UnknownSymbolError,
-    FileNotFoundError
+    FileNotFoundError,
+    BudgetExceeded
 } ForthEvalResult;
 
 // NOTE: forward-declaration for FunctionEntry type
@@ -63,6 +65,13 @@ typedef struct ForthInterpreter
     SymbolsTable *symbols;
     ForthParser *parser;
     bool is_sandboxed;
+
+    // Evaluation budget, see ForthInterpreter__eval_budgeted
+    bool has_budget;
+    bool budget_exceeded;
+    size_t budget_steps;      // 0 for no limit
+    uint64_t budget_deadline; // CLOCK_MONOTONIC ns, 0 for no limit
+    unsigned budget_ticks;    // steps since the clock was last read
 } ForthInterpreter;
 
 ForthInterpreter *ForthInterpreter__new(bool is_sandboxed);
@@ -92,6 +101,13 @@ typedef struct ForthEvalError {
 
 ForthEvalResult ForthInterpreter__eval(ForthInterpreter *self, ForthObject *expr);
 ForthEvalResult ForthInterpreter__eval_every(ForthInterpreter *self, ForthObject *expr);
+/*
+Like ForthInterpreter__eval_every, but gives up after max_steps evaluations or
+max_ms milliseconds (0 for no limit), returning BudgetExceeded: every running
+loop and callee is aborted, and the objects pushed on the stack meanwhile are
+dropped. Nested calls run within the budget of the outermost one.
+*/
+ForthEvalResult ForthInterpreter__eval_budgeted(ForthInterpreter *self, ForthObject *expr, size_t max_steps, unsigned max_ms);
 ForthEvalError *ForthInterpreter__parse_eval(ForthInterpreter *self, char *text);
 ForthEvalError *ForthInterpreter__run_file(ForthInterpreter *self, char *file_path);
 
@@ -95,7 +95,8 @@ void ForthObject__drop(ForthObject *self)
             break;
         case String:
         case Symbol:
-            free(self->string.chars);
+            if (!self->string.borrowed)
+                free(self->string.chars);
             break;
         default:
             break;
@@ -127,12 +128,45 @@ ForthObject *ForthObject__new_string(char *string, size_t len)
     memcpy(obj->string.chars, string, len);
     obj->string.chars[len] = '\0';
     obj->string.symbol_flag = Unquoted;
+    obj->string.borrowed = false;
     obj->string.len = len;
     obj->ref_count = 1;
 
     return obj;
 }
 
+// A string referencing chars it doesn't own, that must be null terminated
+// at len and stay unchanged until the view is dropped or materialized.
+ForthObject *ForthObject__new_string_view(char *string, size_t len)
+{
+    ForthObject *obj = malloc(sizeof(*obj));
+    if (!obj)
+        abort();
+    obj->type = String;
+    obj->string.chars = string;
+    obj->string.symbol_flag = Unquoted;
+    obj->string.borrowed = true;
+    obj->string.len = len;
+    obj->ref_count = 1;
+
+    return obj;
+}
+
+// Turn a view into a string owning a copy of its chars, before they change.
+void ForthObject__materialize(ForthObject *self)
+{
+    if (self->type != String || !self->string.borrowed)
+        return;
+
+    char *chars = malloc(self->string.len + 1);
+    if (!chars)
+        abort();
+    memcpy(chars, self->string.chars, self->string.len);
+    chars[self->string.len] = '\0';
+    self->string.chars = chars;
+    self->string.borrowed = false;
+}
+
 ForthObject *ForthObject__new_symbol(char *string, size_t len, ForthSymbolFlag symbol_flag)
 {
     ForthObject *obj = malloc(sizeof(*obj));
@@ -146,6 +180,7 @@ ForthObject *ForthObject__new_symbol(char *string, size_t len, ForthSymbolFlag s
     obj->string.chars[len] = '\0';
     obj->string.len = len;
     obj->string.symbol_flag = symbol_flag;
+    obj->string.borrowed = false;
     obj->ref_count = 1;
 
     return obj;
@@ -44,6 +44,8 @@ typedef struct ForthObject
         {
             size_t len;
             ForthSymbolFlag symbol_flag;
+            // NOTE: borrowed strings (views) don't own chars, see new_string_view
+            bool borrowed;
             char *chars;
         } string;
         struct
@@ -64,6 +66,8 @@ void ForthObject__drop(ForthObject *obj);
 // Factories
 ForthObject *ForthObject__new_number(double num);
 ForthObject *ForthObject__new_string(char *string, size_t len);
+ForthObject *ForthObject__new_string_view(char *string, size_t len);
+void ForthObject__materialize(ForthObject *self);
 ForthObject *ForthObject__new_symbol(char *string, size_t len, ForthSymbolFlag symbol_flag);
 ForthObject *ForthObject__new_list(size_t cap, bool quasiquoted);
 
@@ -320,6 +320,9 @@ void ForthLspServer__publish_diagnostics(ForthLspServer *server, const char *uri
             case FileNotFoundError:
                 message = "File not found";
                 break;
+            case BudgetExceeded:
+                message = "Evaluation budget exceeded";
+                break;
             default:
                 break;
         }
@@ -54,14 +54,44 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #ifdef PLUGINS_ENABLED
 #include "ForthBuiltins.h"
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <dirent.h>
-#include <pthread.h>
 #include <sys/stat.h>
 #endif
 
+/* Return the time elapsed since an arbitrary point in the past (the
+ * monotonic clock), in microseconds. Used to time things. */
+uint64_t ustime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* With KILO_TRACE set in the environment, log what happens at startup,
+ * and how long it takes, on standard error. */
+void editorTrace(const char *fmt, ...) {
+    static int enabled = -1;
+    va_list ap;
+
+    if (enabled == -1) enabled = getenv("KILO_TRACE") != NULL;
+    if (!enabled) return;
+    va_start(ap,fmt);
+    fprintf(stderr,"Trace: ");
+    vfprintf(stderr,fmt,ap);
+    fprintf(stderr,"\n");
+    va_end(ap);
+}
+
 /* Syntax highlight types */
 #define HL_NORMAL 0
 #define HL_NONPRINT 1
@@ -76,6 +106,13 @@
 #define HL_HIGHLIGHT_STRINGS (1<<0)
 #define HL_HIGHLIGHT_NUMBERS (1<<1)
 
+/* A slot of the keywords perfect hash table. */
+struct editorKeyword {
+    char *word;         /* Keyword, not null terminated. NULL if unused. */
+    int len;            /* Keyword length, without the '|' suffix. */
+    int hl;             /* HL_KEYWORD1 or HL_KEYWORD2. */
+};
+
 struct editorSyntax {
     char **filematch;
     char **keywords;
@@ -83,6 +120,13 @@ struct editorSyntax {
     char multiline_comment_start[3];
     char multiline_comment_end[3];
     int flags;
+    /* Filled by editorSyntaxCompile(): */
+    struct editorKeyword *kwtable;  /* Keywords perfect hash table. */
+    unsigned int kwmask;            /* Table size minus one. */
+    uint32_t kwseed;                /* Hash seed giving no collisions. */
+    /* Only for the syntaxes defined at run time: */
+    char *name;
+    struct syntaxDFA *dfa;          /* Compiled lexer. */
 };
 
 /* This structure represents a single line of the file we are editing. */
@@ -93,8 +137,16 @@ typedef struct erow {
     char *chars;        /* Row content. */
     char *render;       /* Row content "rendered" for screen (for TABs). */
     unsigned char *hl;  /* Syntax highlight type for each character in render.*/
+    int hl_in;          /* Row started inside a multi line comment in last
+                           syntax highlight check. */
     int hl_oc;          /* Row had open comment at end in last syntax highlight
                            check. */
+    uint32_t uid;       /* Stable id, renewed when the content changes. */
+#ifdef PLUGINS_ENABLED
+    struct ForthObject **views; /* Plugin views of 'chars', see
+                                   editorRowView(). */
+    int numviews, viewscap;
+#endif
 } erow;
 
 typedef struct hlcolor {
@@ -107,109 +159,269 @@ typedef struct hlcolor {
 //       [17 'cursor_down kilo_onkey]
 struct onKeyCallback {
     int key;                /* Key that triggerst eh callback */
+    int plugin;             /* Plugin that registered it, see Plugins */
     ForthObject *cb_obj;    /* List or Symbol */
 };
 
-// forth builtin: kilo_ontimeout
-// e.g.: [1000 [time_now kilo_set_status_msg] define]
-struct onTimeoutCallback {
-    int timeout_ms;         /* Timeout in milliseconds */
+/* The plugin files found, so that what a plugin registered can be dropped
+ * when it is reloaded. Callbacks remember the index of their plugin: the
+ * one being loaded, or whose callback was running, when they were
+ * registered (-1 for none).
+ *
+ * A plugin can be loaded lazily, on first use, declaring in header lines
+ * what it binds:
+ *
+ *     #! kilo-keys: 105 27       load it when one of these keys is pressed
+ *     #! kilo-filetypes: .c .h   load it when a matching file is opened
+ *     #! kilo-timers: 1000       load it after that many milliseconds */
+struct pluginFile {
+    char *path;
+    int loaded;             /* Evaluated, not just declared? */
+    int *keys;
+    int numkeys;
+    char **filetypes;
+    int numfiletypes;
+};
+
+static struct pluginFile *Plugins;
+static int NumPlugins;
+static int CurrentPlugin = -1;
+
+// forth builtin: kilo_onidle
+// e.g.: 500 [kilo_save 0] kilo_onidle
+/* Idle callbacks run from the editor loop once no key was typed for
+ * 'quiet_ms', so they never delay the handling of a keystroke. Long jobs
+ * are split in time slices: a callback leaving a nonzero number on the
+ * stack wants to be called again, and it is, until it leaves zero, or
+ * until a key is typed, in which case it resumes in the next idle period. */
+struct onIdleCallback {
+    int quiet_ms;           /* Input inactivity before the callback runs. */
+    int state;              /* IDLE_* */
+    int plugin;
     ForthObject *cb_obj;    /* List or Symbol */
 };
 
+#define IDLE_ARMED 0        /* Will run in the next idle period. */
+#define IDLE_WORKING 1      /* Has more work, resumes when idle. */
+#define IDLE_DONE 2         /* Ran in this idle period, waits for input. */
+
 struct callbackTable {
     ForthObject *onExitCallback;
+    int onExitPlugin;
 
     struct onKeyCallback *onKeyCallbacks;
     int onKeyCallbacksLen;
 
-    struct onTimeoutCallback *onTimeoutCallbacks;
-    int onTimeoutCallbacksLen;
+    struct onIdleCallback *onIdleCallbacks;
+    int onIdleCallbacksLen;
 };
 
-struct callbackSchedule {
-    int delta_ms;
-    int n_states;
-    ForthObject ***callbacks;
+/* Plugins only run in the main thread, that owns the interpreter and the
+ * editor state: other threads post messages to the main loop in a lock
+ * free multi producer single consumer queue (the intrusive one of Dmitry
+ * Vyukov), and wake it up writing to an eventfd it polls along with the
+ * terminal. The queue always holds a stub message, so that pushing is
+ * a single atomic exchange. */
+#define LOOP_MSG_STUB 0
+#define LOOP_MSG_TIMER 1    /* Timer 'id' is due. */
+#define LOOP_MSG_JOB 2      /* Job 'data' is done. */
+#define LOOP_MSG_PLUGIN 3   /* Plugin file 'data' changed, 'id' 0 if gone. */
+
+struct loopMsg {
+    _Atomic(struct loopMsg *) next;
+    int type;               /* LOOP_MSG_* */
+    int id;
+    void *data;
 };
 
-struct callbackSchedule *computeCallbackSchedule(struct callbackTable *callbacks)
+struct loopQueue {
+    _Atomic(struct loopMsg *) head;     /* Last pushed, producers side. */
+    struct loopMsg *tail;               /* Next to pop, consumer side. */
+    struct loopMsg stub;
+    int efd;                            /* eventfd, or -1. */
+};
+
+static struct loopQueue Loop = { .efd = -1 };
+
+void loopQueueInit(void)
+{
+    atomic_init(&Loop.stub.next, NULL);
+    Loop.stub.type = LOOP_MSG_STUB;
+    atomic_init(&Loop.head, &Loop.stub);
+    Loop.tail = &Loop.stub;
+    Loop.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+void loopQueueLink(struct loopMsg *msg)
+{
+    atomic_store_explicit(&msg->next, NULL, memory_order_relaxed);
+    struct loopMsg *prev = atomic_exchange_explicit(&Loop.head, msg, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, msg, memory_order_release);
+}
+
+/* Post a message to the main loop: can be called from any thread. */
+void loopPost(int type, int id, void *data)
+{
+    struct loopMsg *msg = malloc(sizeof(*msg));
+    uint64_t one = 1;
+
+    msg->type = type;
+    msg->id = id;
+    msg->data = data;
+    loopQueueLink(msg);
+    if (write(Loop.efd, &one, sizeof(one)) == -1) {
+        /* Counter overflow: the main loop has a wake up pending anyway. */
+    }
+}
+
+/* Pop the oldest message, to be freed by the caller, or return NULL if
+ * the queue is empty, or a push is half done: its eventfd write is still
+ * to come, so the main loop will be back. Main thread only. */
+struct loopMsg *loopQueuePop(void)
 {
+    struct loopMsg *tail = Loop.tail;
+    struct loopMsg *next = atomic_load_explicit(&tail->next, memory_order_acquire);
 
-    if (callbacks->onTimeoutCallbacksLen == 0)
+    if (tail == &Loop.stub) {
+        if (next == NULL) return NULL;
+        Loop.tail = tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next) {
+        Loop.tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&Loop.head, memory_order_acquire))
         return NULL;
+    loopQueueLink(&Loop.stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        Loop.tail = next;
+        return tail;
+    }
+    return NULL;
+}
 
-    int max_timeout = callbacks->onTimeoutCallbacks[0].timeout_ms;
-    int max_common_denominator = max_timeout;
-    for (int i = 1; i < callbacks->onTimeoutCallbacksLen; i++) {
-        int t = callbacks->onTimeoutCallbacks[i].timeout_ms;
-        if (t > max_timeout)
-            max_timeout = t;
-
-        // compute GCD
-        int a = max_common_denominator;
-        int b = t;
-        while (b != 0) {
-            int temp = b;
-            b = a % b;
-            a = temp;
-        }
-        max_common_denominator = a;
-    }
-
-    struct callbackSchedule *schedule = malloc(sizeof(*schedule));
-    schedule->delta_ms = max_common_denominator;
-    schedule->n_states = 0;
-    schedule->callbacks = NULL;
-
-    int t = max_common_denominator;
-    
-    while (t <= max_timeout) {
-        schedule->callbacks = realloc(schedule->callbacks, sizeof(ForthObject **) * (schedule->n_states + 1));
-        schedule->callbacks[schedule->n_states] = NULL;
-
-        int cbs_in_state = 0;
-        for (int i = 0; i < callbacks->onTimeoutCallbacksLen; i++) {
-            if (t % callbacks->onTimeoutCallbacks[i].timeout_ms == 0) {
-                schedule->callbacks[schedule->n_states] = realloc(
-                    schedule->callbacks[schedule->n_states],
-                    sizeof(ForthObject *) * (cbs_in_state + 1)
-                );
-                schedule->callbacks[schedule->n_states][cbs_in_state] =
-                    callbacks->onTimeoutCallbacks[i].cb_obj;
-                cbs_in_state += 1;
-            }
-        }
+// forth builtin: kilo_ontimeout, kilo_after, kilo_cancel_timer
+// e.g.: 1000 [now kilo_set_status_msg] kilo_ontimeout 'clock_timer define
+//       clock_timer kilo_cancel_timer
+/* Timers are kept by the timer thread, see timeoutHandler(), in a
+ * min-heap ordered by deadline, an absolute CLOCK_MONOTONIC time, so it
+ * sleeps until exactly the first one is due, whatever the periods. It
+ * never touches the callbacks: it posts LOOP_MSG_TIMER messages, and the
+ * main thread looks the callback up by id. */
+struct timerEntry {
+    uint64_t deadline;      /* Next run, in microseconds. */
+    uint64_t period;        /* In microseconds, 0 for one shot timers. */
+    int id;                 /* Handle given to the plugins. */
+    int queued;             /* Posted and not yet run: don't post again. */
+};
 
-        if (cbs_in_state > 0)
-        {
-            schedule->callbacks[schedule->n_states] = realloc(
-                schedule->callbacks[schedule->n_states],
-                sizeof(ForthObject *) * (cbs_in_state + 1)
-            );
+struct timerHeap {
+    struct timerEntry *entries;
+    int len;
+    int cap;
+};
 
-            schedule->callbacks[schedule->n_states][cbs_in_state] = NULL;
-        }
+struct timerCallback {
+    int id;
+    int periodic;
+    int plugin;
+    ForthObject *cb_obj;    /* List or Symbol */
+};
+
+/* Timers can be added and cancelled at any time, even by the timer
+ * callbacks themselves, so the heap is protected by a lock, and the timer
+ * thread waits on a condition variable, signaled when the first deadline
+ * may have changed. The callbacks are only accessed by the main thread. */
+struct timerScheduler {
+    struct timerHeap heap;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int next_id;
+    int started;            /* Is the timer thread running? */
+
+    struct timerCallback *callbacks;
+    int numcallbacks;
+};
+
+static struct timerScheduler Timers;
+
+void timerHeapSiftUp(struct timerHeap *h, int i)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (h->entries[parent].deadline <= h->entries[i].deadline)
+            break;
+        struct timerEntry tmp = h->entries[parent];
+        h->entries[parent] = h->entries[i];
+        h->entries[i] = tmp;
+        i = parent;
+    }
+}
 
-        t += max_common_denominator;
-        schedule->n_states += 1;
+void timerHeapSiftDown(struct timerHeap *h, int i)
+{
+    while (1) {
+        int min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < h->len && h->entries[l].deadline < h->entries[min].deadline)
+            min = l;
+        if (r < h->len && h->entries[r].deadline < h->entries[min].deadline)
+            min = r;
+        if (min == i)
+            break;
+        struct timerEntry tmp = h->entries[min];
+        h->entries[min] = h->entries[i];
+        h->entries[i] = tmp;
+        i = min;
     }
+}
 
-    return schedule;
+void timerHeapPush(struct timerHeap *h, struct timerEntry *e)
+{
+    if (h->len == h->cap) {
+        h->cap = h->cap ? h->cap * 2 : 8;
+        h->entries = realloc(h->entries, sizeof(struct timerEntry) * h->cap);
+    }
+    h->entries[h->len++] = *e;
+    timerHeapSiftUp(h, h->len - 1);
 }
 
-void freeCallbackSchedule(struct callbackSchedule *schedule)
+/* Remove the entry at 'i' from the heap. */
+void timerHeapRemove(struct timerHeap *h, int i)
 {
-    for (int i = 0; i < schedule->n_states; i++)
-        if (schedule->callbacks[i])
-            free(schedule->callbacks[i]);
+    h->entries[i] = h->entries[--h->len];
+    if (i < h->len) {
+        timerHeapSiftDown(h, i);
+        timerHeapSiftUp(h, i);
+    }
+}
 
-    free(schedule->callbacks);
-    free(schedule);
+/* The periodic timer 'e' just ran: move its deadline one period ahead.
+ * Adding the period to the previous deadline, rather than to the current
+ * time, keeps the runs from drifting. If whole periods were missed (a slow
+ * callback, a suspended process) they are coalesced into the run that
+ * just happened, instead of running in a burst. */
+void timerAdvance(struct timerEntry *e, uint64_t now)
+{
+    e->deadline += e->period;
+    if (e->deadline <= now)
+        e->deadline += ((now - e->deadline) / e->period + 1) * e->period;
 }
 
 #endif
 
+/* A keyboard macro: a compact list of decoded key codes (see KEY_ACTION,
+ * every code fits in 16 bits) recorded while the user edits, that can be
+ * replayed in batch. */
+struct editorMacro {
+    uint16_t *keys;     /* Recorded keys. */
+    int len;            /* Number of recorded keys. */
+    int cap;            /* Allocated slots in 'keys'. */
+    int recording;      /* Are we appending processed keys to 'keys'? */
+    int playing;        /* Is a replay in progress? */
+};
+
 struct editorConfig {
     int cx,cy;  /* Cursor x and y position in characters */
     int rowoff;     /* Offset of row displayed. */
@@ -217,13 +429,25 @@ struct editorConfig {
     int screenrows; /* Number of rows that we can show */
     int screencols; /* Number of cols that we can show */
     int numrows;    /* Number of rows */
+    int hl_stale;   /* First row whose highlight may be stale, or -1. */
+    int hl_deferred;    /* Leave new rows to the highlighting threads. */
+    struct hlJob *hljob;    /* Background highlighting in progress, or NULL. */
+    int rows_gen;   /* Incremented every time rows are added or removed. */
+    int version;    /* Incremented every time rows change in any way. */
+    uint32_t next_uid;  /* Id for the next row that changes. */
+    struct triIndex *tri;   /* Trigram index, or NULL. */
+    struct triBuild *tribuild;  /* Trigram index build in progress. */
     int rawmode;    /* Is terminal raw mode enabled? */
+    int batch;      /* Running without a terminal, see editorBatch(). */
     erow *row;      /* Rows */
     int dirty;      /* File modified but not saved. */
     char *filename; /* Currently open filename */
     char statusmsg[80];
     time_t statusmsg_time;
     struct editorSyntax *syntax;    /* Current syntax highlight, or NULL. */
+    struct editorMacro macro;   /* Keyboard macro. */
+    struct searchIndex *find;   /* Matches highlighted by find, or NULL. */
+    volatile int norefresh;     /* Screen refresh suppressed if non zero. */
 
 #ifdef PLUGINS_ENABLED
     struct callbackTable *callbacks;
@@ -235,6 +459,66 @@ static struct editorConfig E;
 #ifdef PLUGINS_ENABLED
 static ForthInterpreter *F;
 
+// kilo_get_row and kilo_get_rows return views of the rows instead of
+// copies. Every row keeps its views, and turns them into copies right
+// before it changes, see editorRowChanging(). The views no one else
+// references anymore are forgotten then, or by a sweep of all the rows
+// once many views were created.
+struct rowViews {
+    int len;        // views kept by all the rows
+    int sweep_at;   // len that triggers the next sweep
+};
+static struct rowViews RowViews = {0, 1024};
+
+// forget the views of row no one else references anymore
+void rowViewsSweep(erow *row) {
+    int kept = 0;
+    for (int i = 0; i < row->numviews; i++) {
+        ForthObject *view = row->views[i];
+        if (view->ref_count == 1) {
+            ForthObject__drop(view);
+            RowViews.len--;
+        } else {
+            row->views[kept++] = view;
+        }
+    }
+    row->numviews = kept;
+}
+
+ForthObject *editorRowView(erow *row) {
+    if (RowViews.len >= RowViews.sweep_at) {
+        // the next sweep comes after as many views as this one visits
+        for (int i = 0; i < E.numrows; i++)
+            if (E.row[i].numviews)
+                rowViewsSweep(E.row + i);
+        RowViews.sweep_at = RowViews.len * 2 + E.numrows + 1024;
+    }
+    if (row->numviews == row->viewscap) {
+        rowViewsSweep(row);
+        if (row->numviews == row->viewscap) {
+            row->viewscap = row->viewscap ? row->viewscap * 2 : 2;
+            row->views = realloc(row->views, sizeof(ForthObject *) * row->viewscap);
+        }
+    }
+    ForthObject *view = ForthObject__new_string_view(row->chars, row->size);
+    row->views[row->numviews++] = ForthObject__rc_clone(view);
+    RowViews.len++;
+
+    return view;
+}
+
+// materialize the views of row still referenced, forgetting all of them
+void editorReleaseRowViews(erow *row) {
+    for (int i = 0; i < row->numviews; i++) {
+        ForthObject *view = row->views[i];
+        if (view->ref_count > 1)
+            ForthObject__materialize(view);
+        ForthObject__drop(view);
+    }
+    RowViews.len -= row->numviews;
+    row->numviews = 0;
+}
+
 ForthEvalResult kiloGetRow(ForthInterpreter *f) {
     ForthObject *idx_arg = NULL;
     ForthEvalResult args_res = ForthInterpreter__pop_args(f, 1, &idx_arg, Number);
@@ -247,9 +531,7 @@ ForthEvalResult kiloGetRow(ForthInterpreter *f) {
     if (idx >= E.numrows)
         return IndexError;
 
-    erow *row = E.row + idx;
-    ForthObject *res = ForthObject__new_string(row->chars, row->size);
-    ForthObject__list_push_move(f->stack, res);
+    ForthObject__list_push_move(f->stack, editorRowView(E.row + idx));
 
     return Ok;
 }
@@ -257,6 +539,7 @@ ForthEvalResult kiloGetRow(ForthInterpreter *f) {
 void editorInsertRow(int at, char *s, size_t len);
 void editorUpdateRow(erow* row);
 void editorDelRow(int at);
+void editorRowChanging(erow *row);
 
 ForthEvalResult kiloSetRow(ForthInterpreter *f) {
     ForthObject *idx_arg = NULL, *row_arg = NULL;
@@ -274,9 +557,11 @@ ForthEvalResult kiloSetRow(ForthInterpreter *f) {
     else
     {
         erow *row = E.row + idx;
+        editorRowChanging(row);
         row->size = row_arg->string.len;
-        row->chars = realloc(row->chars, row->size);
+        row->chars = realloc(row->chars, row->size + 1);
         memcpy(row->chars, row_arg->string.chars, row->size);
+        row->chars[row->size] = '\0';
         editorUpdateRow(row);
     }
 
@@ -285,6 +570,294 @@ ForthEvalResult kiloSetRow(ForthInterpreter *f) {
     return Ok;
 }
 
+void editorEditRows(int at, int del, char **lines, int *lens, int n);
+
+// pops a start and an end row index, in this order, clamping the end to
+// the number of rows
+ForthEvalResult kiloPopRowRange(ForthInterpreter *f, int *start, int *end) {
+    ForthObject *start_arg = NULL, *end_arg = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 2, &end_arg, Number, &start_arg, Number);
+    if (args_res != Ok)
+        return args_res;
+
+    *start = (int)start_arg->num;
+    *end = (int)end_arg->num;
+    ForthObject__drop(start_arg);
+    ForthObject__drop(end_arg);
+
+    if (*end > E.numrows)
+        *end = E.numrows;
+    if (*start < 0 || *start > *end)
+        return IndexError;
+
+    return Ok;
+}
+
+// forth builtin: kilo_get_rows
+// e.g.: 0 kilo_get_numrows kilo_get_rows
+// returns a list with the rows from start to end (excluded)
+ForthEvalResult kiloGetRows(ForthInterpreter *f) {
+    int start, end;
+    ForthEvalResult args_res = kiloPopRowRange(f, &start, &end);
+    if (args_res != Ok)
+        return args_res;
+
+    ForthObject *res = ForthObject__new_list(end - start, false);
+    for (int i = start; i < end; i++)
+        ForthObject__list_push_move(res, editorRowView(E.row + i));
+    ForthObject__list_push_move(f->stack, res);
+
+    return Ok;
+}
+
+// replaces del rows at idx with the strings of the list lines, in a single
+// undoable edit
+ForthEvalResult kiloEditRows(ForthObject *lines, int idx, int del) {
+    int n = lines->list.len;
+    char **chars = malloc(sizeof(char *) * (n + 1));
+    int *lens = malloc(sizeof(int) * (n + 1));
+    ForthEvalResult res = Ok;
+
+    for (int i = 0; i < n && res == Ok; i++) {
+        ForthObject *line = lines->list.data[i];
+        if (line->type != String)
+            res = TypeError;
+        else {
+            chars[i] = line->string.chars;
+            lens[i] = line->string.len;
+        }
+    }
+    if (res == Ok)
+        editorEditRows(idx, del, chars, lens, n);
+    free(chars);
+    free(lens);
+
+    return res;
+}
+
+// forth builtin: kilo_set_rows
+// e.g.: ["first" "second"] 0 kilo_set_rows
+// overwrites the rows from the index on, adding rows past the last one
+ForthEvalResult kiloSetRows(ForthInterpreter *f) {
+    ForthObject *idx_arg = NULL, *lines_arg = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 2, &idx_arg, Number, &lines_arg, List);
+    if (args_res != Ok)
+        return args_res;
+
+    int idx = (int)idx_arg->num;
+    ForthObject__drop(idx_arg);
+
+    if (idx < 0 || idx > E.numrows)
+        args_res = IndexError;
+    else
+        args_res = kiloEditRows(lines_arg, idx, lines_arg->list.len);
+    ForthObject__drop(lines_arg);
+
+    return args_res;
+}
+
+// forth builtin: kilo_insert_rows
+// e.g.: ["first" "second"] 0 kilo_insert_rows
+// inserts the rows before the index, shifting the following ones down
+ForthEvalResult kiloInsertRows(ForthInterpreter *f) {
+    ForthObject *idx_arg = NULL, *lines_arg = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 2, &idx_arg, Number, &lines_arg, List);
+    if (args_res != Ok)
+        return args_res;
+
+    int idx = (int)idx_arg->num;
+    ForthObject__drop(idx_arg);
+
+    if (idx < 0 || idx > E.numrows)
+        args_res = IndexError;
+    else
+        args_res = kiloEditRows(lines_arg, idx, 0);
+    ForthObject__drop(lines_arg);
+
+    return args_res;
+}
+
+// forth builtin: kilo_delete_rows
+// e.g.: 0 10 kilo_delete_rows
+// deletes the rows from start to end (excluded)
+ForthEvalResult kiloDeleteRows(ForthInterpreter *f) {
+    int start, end;
+    ForthEvalResult args_res = kiloPopRowRange(f, &start, &end);
+    if (args_res != Ok)
+        return args_res;
+
+    if (end > start)
+        editorEditRows(start, end - start, NULL, NULL, 0);
+
+    return Ok;
+}
+
+struct editorSyntax;
+struct editorSyntax *editorDefineSyntax(const char *text, size_t len,
+                                        const char *origin);
+int editorSyntaxMatches(struct editorSyntax *s, char *filename);
+void editorSetSyntax(struct editorSyntax *s);
+
+// forth builtin: kilo_define_syntax
+// e.g.: ["syntax ini" "filematch .ini" "comment ;"] kilo_define_syntax
+// the definition is a string, or a list of strings (the lines)
+ForthEvalResult kiloDefineSyntax(ForthInterpreter *f) {
+    ForthObject *def_arg = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 1, &def_arg, String | List);
+    if (args_res != Ok)
+        return args_res;
+
+    char *text = NULL;
+    size_t len = 0;
+    if (def_arg->type == String) {
+        text = malloc(def_arg->string.len);
+        memcpy(text, def_arg->string.chars, def_arg->string.len);
+        len = def_arg->string.len;
+    } else {
+        for (size_t i = 0; i < def_arg->list.len; i++) {
+            ForthObject *line = def_arg->list.data[i];
+            if (line->type != String) {
+                free(text);
+                ForthObject__drop(def_arg);
+                return TypeError;
+            }
+            text = realloc(text, len + line->string.len + 1);
+            memcpy(text + len, line->string.chars, line->string.len);
+            len += line->string.len;
+            text[len++] = '\n';
+        }
+    }
+    ForthObject__drop(def_arg);
+
+    struct editorSyntax *s = editorDefineSyntax(text, len, "kilo_define_syntax");
+    free(text);
+    if (!s)
+        return ParsingError;
+
+    if (E.filename && editorSyntaxMatches(s, E.filename))
+        editorSetSyntax(s);
+
+    return Ok;
+}
+
+struct regex;
+struct regex *regexCompile(const char *pat, int len, int flags,
+                           const char **err);
+void regexFree(struct regex *re);
+int regexMatches(struct regex *re, const char *s, int len);
+int regexExec(struct regex *re, const char *s, int len, int from, int *caps);
+int regexGroups(struct regex *re);
+void editorSetStatusMessage(const char *fmt, ...);
+
+// forth builtin: kilo_find_regex
+// e.g.: "^#define (\w+)" kilo_find_regex
+// returns a list with a [row col len] list for every match, followed by
+// the col and len of every group (-1 -1 if the group did not match)
+ForthEvalResult kiloFindRegex(ForthInterpreter *f) {
+    ForthObject *pat_arg = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 1, &pat_arg, String);
+    if (args_res != Ok)
+        return args_res;
+
+    const char *err = NULL;
+    struct regex *re = regexCompile(pat_arg->string.chars, pat_arg->string.len, 0, &err);
+    ForthObject__drop(pat_arg);
+    if (!re) {
+        editorSetStatusMessage("kilo_find_regex: %s", err);
+        return ParsingError;
+    }
+
+    int ngroups = regexGroups(re);
+    int *caps = malloc(sizeof(int) * ngroups * 2);
+    ForthObject *res = ForthObject__new_list(0, false);
+    for (int i = 0; i < E.numrows; i++) {
+        erow *row = E.row + i;
+        if (!regexMatches(re, row->chars, row->size))
+            continue;
+
+        int from = 0;
+        while (from <= row->size && regexExec(re, row->chars, row->size, from, caps)) {
+            ForthObject *match = ForthObject__new_list(2 + ngroups * 2, false);
+            ForthObject__list_push_move(match, ForthObject__new_number(i));
+            ForthObject__list_push_move(match, ForthObject__new_number(caps[0]));
+            ForthObject__list_push_move(match, ForthObject__new_number(caps[1] - caps[0]));
+            for (int g = 1; g < ngroups; g++) {
+                int start = caps[g * 2], end = caps[g * 2 + 1];
+                ForthObject__list_push_move(match, ForthObject__new_number(start));
+                ForthObject__list_push_move(match, ForthObject__new_number(start == -1 ? -1 : end - start));
+            }
+            ForthObject__list_push_move(res, match);
+            from = caps[1] > caps[0] ? caps[1] : caps[1] + 1;
+        }
+    }
+    free(caps);
+    regexFree(re);
+    ForthObject__list_push_move(f->stack, res);
+
+    return Ok;
+}
+
+int *editorFindAll(char *query, int qlen, int *count);
+
+// forth builtin: kilo_find
+// e.g.: "TODO" kilo_find
+// returns a list with a [row col len] list for every occurrence of the string
+ForthEvalResult kiloFind(ForthInterpreter *f) {
+    ForthObject *query_arg = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 1, &query_arg, String);
+    if (args_res != Ok)
+        return args_res;
+
+    int count;
+    int *matches = editorFindAll(query_arg->string.chars, query_arg->string.len, &count);
+    ForthObject__drop(query_arg);
+    if (!matches) {
+        editorSetStatusMessage("kilo_find: query too long");
+        return IndexError;
+    }
+
+    ForthObject *res = ForthObject__new_list(count, false);
+    for (int i = 0; i < count; i++) {
+        ForthObject *match = ForthObject__new_list(3, false);
+        for (int j = 0; j < 3; j++)
+            ForthObject__list_push_move(match, ForthObject__new_number(matches[i * 3 + j]));
+        ForthObject__list_push_move(res, match);
+    }
+    free(matches);
+    ForthObject__list_push_move(f->stack, res);
+
+    return Ok;
+}
+
+int editorReplaceAll(char *query, int qlen, int flags, char *repl, int rlen,
+                     int *rows, const char **err);
+
+// forth builtin: kilo_replace
+// e.g.: "teh" "the" kilo_replace
+// replaces every occurrence of the first string with the second one, in a
+// single undoable step, and returns the number of replacements
+ForthEvalResult kiloReplace(ForthInterpreter *f) {
+    ForthObject *query_arg = NULL, *repl_arg = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 2, &repl_arg, String, &query_arg, String);
+    if (args_res != Ok)
+        return args_res;
+
+    int rows;
+    const char *err;
+    int count = editorReplaceAll(query_arg->string.chars, query_arg->string.len, 0,
+                                 repl_arg->string.chars, repl_arg->string.len, &rows, &err);
+    ForthObject__drop(query_arg);
+    ForthObject__drop(repl_arg);
+    if (count == -1) {
+        editorSetStatusMessage("kilo_replace: %s", err);
+        return IndexError;
+    }
+
+    ForthObject__list_push_move(f->stack, ForthObject__new_number(count));
+
+    return Ok;
+}
+
 int editorSave(void);
 ForthEvalResult kiloSave(ForthInterpreter *f)
 {
@@ -397,6 +970,28 @@ ForthEvalResult kiloProcessKeyRecursive(ForthInterpreter *f) {
     return Ok;
 }
 
+void editorMacroToggleRecording(void);
+void editorMacroPlay(int times);
+
+ForthEvalResult kiloMacroRecord(ForthInterpreter *f) {
+    (void)f;
+    editorMacroToggleRecording();
+
+    return Ok;
+}
+
+ForthEvalResult kiloMacroPlay(ForthInterpreter *f) {
+    ForthObject *times = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 1, &times, Number);
+    if (args_res != Ok)
+        return args_res;
+
+    editorMacroPlay((int)times->num);
+    ForthObject__drop(times);
+
+    return Ok;
+}
+
 ForthEvalResult kiloGetStatusMessage(ForthInterpreter *f) {
     int status_msg_len = strlen(E.statusmsg);
     ForthObject *res = ForthObject__new_string(E.statusmsg, status_msg_len);
@@ -416,115 +1011,1186 @@ ForthEvalResult kiloOnExit(ForthInterpreter *f) {
         E.callbacks = calloc(1, sizeof(*E.callbacks));
     }
 
+    if (E.callbacks->onExitCallback)
+        ForthObject__drop(E.callbacks->onExitCallback);
     E.callbacks->onExitCallback = obj;
+    E.callbacks->onExitPlugin = CurrentPlugin;
 
     return Ok;
 }
 
-ForthEvalResult kiloOnTimeout(ForthInterpreter *f) {
-    ForthObject *obj = NULL, *timeout = NULL;
-    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 2, &obj, Symbol | List, &timeout, Number);
-    if (args_res != Ok)
-        return args_res;
+/* Budget of the plugin callbacks run by the editor: one stuck in a loop
+ * is aborted with BudgetExceeded instead of freezing the editor. Jobs run
+ * out of the main thread, so they only get a larger time limit. */
+#define KILO_CB_MAX_STEPS 10000000
+#define KILO_CB_MAX_MS 250
+#define KILO_JOB_MAX_MS 10000
+
+// forth builtin: kilo_plugin_stats
+// e.g.: kilo_plugin_stats 0 at -> ["key 20" count mean_ms p50 p90 p99 max]
+/* Every plugin callback run by the editor is timed, and its latency added
+ * to the histogram of its key, timer, ... Histograms are log-linear, like
+ * HdrHistogram: values below PROF_SUB microseconds have a bucket each,
+ * then every power of two range is split in PROF_SUB buckets, so any value
+ * is known within 1/PROF_SUB (6%), in a few KB per histogram. */
+#define PROF_KEY 0
+#define PROF_TIMER 1
+#define PROF_IDLE 2
+#define PROF_JOB 3
+#define PROF_EXIT 4
+
+static const char *ProfKindNames[] = {"key", "timer", "idle", "job", "exit"};
+
+#define PROF_SUB_BITS 4
+#define PROF_SUB (1<<PROF_SUB_BITS)
+#define PROF_MAX_SHIFT 36       /* Up to 2^40 us, that's 12 days. */
+#define PROF_BUCKETS ((PROF_MAX_SHIFT+2)*PROF_SUB)
+
+struct profHist {
+    int kind;                   /* PROF_* */
+    int id;                     /* Key code, timer id, idle callback index. */
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint32_t buckets[PROF_BUCKETS];
+};
 
-    int t = (int)timeout->num;
-    ForthObject__drop(timeout);
+static struct profHist *Prof;
+static int ProfLen;
 
-    if (!E.callbacks) {
-        E.callbacks = calloc(1, sizeof(*E.callbacks));
-    }
+int profBucket(uint64_t us)
+{
+    if (us < PROF_SUB) return (int)us;
 
-    int newlen = E.callbacks->onTimeoutCallbacksLen + 1;
-    struct onTimeoutCallback *newarr = realloc(E.callbacks->onTimeoutCallbacks,
-                                           sizeof(struct onTimeoutCallback) * newlen);
-    if (!newarr) {
-        // out of memory!
-        ForthObject__drop(obj);
-        return Ok;
-    }
-    E.callbacks->onTimeoutCallbacks = newarr;
-    E.callbacks->onTimeoutCallbacksLen = newlen;
+    int shift = 63 - __builtin_clzll(us) - PROF_SUB_BITS;
+    if (shift > PROF_MAX_SHIFT) return PROF_BUCKETS-1;
+    return (shift+1)*PROF_SUB + (int)(us >> shift) - PROF_SUB;
+}
 
-    E.callbacks->onTimeoutCallbacks[newlen - 1].timeout_ms = t;
-    E.callbacks->onTimeoutCallbacks[newlen - 1].cb_obj = obj;
-    fprintf(stderr, "Info: Registered callback on timeout: %d ms\n", t);
+/* Highest value, in microseconds, that falls in bucket 'b'. */
+uint64_t profBucketMax(int b)
+{
+    if (b < PROF_SUB) return b;
 
-    return Ok;
+    int shift = b/PROF_SUB - 1;
+    return ((uint64_t)(PROF_SUB + b%PROF_SUB + 1) << shift) - 1;
 }
 
-ForthEvalResult kiloOnKey(ForthInterpreter *f) {
-    ForthObject *obj = NULL, *key = NULL;
-    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 2, &obj, Symbol | List, &key, Number | String);
-    if (args_res != Ok)
-        return args_res;
+struct profHist *profGet(int kind, int id)
+{
+    for (int i = 0; i < ProfLen; i++)
+        if (Prof[i].kind == kind && Prof[i].id == id) return &Prof[i];
+
+    Prof = realloc(Prof, sizeof(struct profHist) * (ProfLen+1));
+    struct profHist *h = &Prof[ProfLen++];
+    memset(h, 0, sizeof(*h));
+    h->kind = kind;
+    h->id = id;
+    return h;
+}
 
-    int k = key->type == Number ? (int)key->num : (int)*key->string.chars;
-    ForthObject__drop(key);
+void profRecord(int kind, int id, uint64_t us)
+{
+    struct profHist *h = profGet(kind, id);
 
-    if (!E.callbacks) {
-        E.callbacks = calloc(1, sizeof(*E.callbacks));
-    }
+    h->count++;
+    h->total_us += us;
+    if (us > h->max_us) h->max_us = us;
+    h->buckets[profBucket(us)]++;
+}
 
-    int newlen = E.callbacks->onKeyCallbacksLen + 1;
-    struct onKeyCallback *newarr = realloc(E.callbacks->onKeyCallbacks,
-                                           sizeof(struct onKeyCallback) * newlen);
-    if (!newarr) {
-        // out of memory!
-        ForthObject__drop(obj);
-        return Ok;
+/* Latency in milliseconds under which 'pct' percent of the runs were. */
+double profPercentile(struct profHist *h, double pct)
+{
+    uint64_t want = (uint64_t)(h->count * pct / 100.0 + 0.5), seen = 0;
+
+    if (want == 0) want = 1;
+    for (int b = 0; b < PROF_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= want) {
+            uint64_t us = profBucketMax(b);
+            return (us < h->max_us ? us : h->max_us) / 1000.0;
+        }
     }
-    E.callbacks->onKeyCallbacks = newarr;
-    E.callbacks->onKeyCallbacksLen = newlen;
+    return h->max_us / 1000.0;
+}
 
-    E.callbacks->onKeyCallbacks[newlen - 1].key = k;
-    E.callbacks->onKeyCallbacks[newlen - 1].cb_obj = obj;
-    fprintf(stderr, "Info: Registered callback on key: %d\n", k);
+void profName(struct profHist *h, char *buf, size_t size)
+{
+    if (h->kind == PROF_JOB || h->kind == PROF_EXIT)
+        snprintf(buf, size, "%s", ProfKindNames[h->kind]);
+    else
+        snprintf(buf, size, "%s %d", ProfKindNames[h->kind], h->id);
+}
 
-    return Ok;
+int profCompareTotal(const void *a, const void *b)
+{
+    const struct profHist *ha = *(struct profHist **)a, *hb = *(struct profHist **)b;
+    return ha->total_us < hb->total_us ? 1 : ha->total_us > hb->total_us ? -1 : 0;
 }
 
-void editorRefreshScreen(void);
+/* Show in the status bar the callbacks that took longer overall. */
+void editorProfileOverlay(void)
+{
+    struct profHist **sorted = malloc(sizeof(*sorted) * (ProfLen ? ProfLen : 1));
+    char msg[sizeof(E.statusmsg)], name[32];
+    int len = 0;
+
+    for (int i = 0; i < ProfLen; i++) sorted[i] = &Prof[i];
+    qsort(sorted, ProfLen, sizeof(*sorted), profCompareTotal);
+
+    msg[0] = '\0';
+    for (int i = 0; i < ProfLen; i++) {
+        char entry[64];
+        profName(sorted[i], name, sizeof(name));
+        int elen = snprintf(entry, sizeof(entry), "%s%s x%llu p99 %.1fms max %.1fms",
+            i ? " | " : "", name, (unsigned long long)sorted[i]->count,
+            profPercentile(sorted[i], 99), sorted[i]->max_us / 1000.0);
+        if (len + elen >= (int)sizeof(msg)) break;
+        memcpy(msg+len, entry, elen+1);
+        len += elen;
+    }
+    free(sorted);
 
-void timeoutHandler(void *arg) {
-    struct callbackSchedule *schedule = computeCallbackSchedule(E.callbacks);
-    if (!schedule) {
+    if (ProfLen == 0)
+        editorSetStatusMessage("No plugin callback ran yet");
+    else
+        editorSetStatusMessage("%s", msg);
+}
+
+/* Write the histograms to 'filename', when KILO_PROFILE asks for it. */
+void editorProfileDump(const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    char name[32];
+
+    if (!fp) return;
+    fprintf(fp, "# callback count mean_ms p50_ms p90_ms p99_ms max_ms\n");
+    for (int i = 0; i < ProfLen; i++) {
+        struct profHist *h = &Prof[i];
+        profName(h, name, sizeof(name));
+        fprintf(fp, "%s %llu %.3f %.3f %.3f %.3f %.3f\n", name,
+            (unsigned long long)h->count, h->total_us / 1000.0 / h->count,
+            profPercentile(h, 50), profPercentile(h, 90),
+            profPercentile(h, 99), h->max_us / 1000.0);
+        for (int b = 0; b < PROF_BUCKETS; b++) {
+            if (h->buckets[b])
+                fprintf(fp, "  <= %.3f ms: %u\n", profBucketMax(b) / 1000.0, h->buckets[b]);
+        }
+    }
+    fclose(fp);
+}
+
+ForthEvalResult kiloPluginStats(ForthInterpreter *f) {
+    ForthObject *stats = ForthObject__new_list(ProfLen ? ProfLen : 1, false);
+    char name[32];
+
+    for (int i = 0; i < ProfLen; i++) {
+        struct profHist *h = &Prof[i];
+        ForthObject *entry = ForthObject__new_list(7, false);
+
+        profName(h, name, sizeof(name));
+        ForthObject__list_push_move(entry, ForthObject__new_string(name, strlen(name)));
+        ForthObject__list_push_move(entry, ForthObject__new_number(h->count));
+        ForthObject__list_push_move(entry, ForthObject__new_number(h->total_us / 1000.0 / h->count));
+        ForthObject__list_push_move(entry, ForthObject__new_number(profPercentile(h, 50)));
+        ForthObject__list_push_move(entry, ForthObject__new_number(profPercentile(h, 90)));
+        ForthObject__list_push_move(entry, ForthObject__new_number(profPercentile(h, 99)));
+        ForthObject__list_push_move(entry, ForthObject__new_number(h->max_us / 1000.0));
+        ForthObject__list_push_move(stats, entry);
+    }
+    ForthObject__list_push_move(f->stack, stats);
+
+    return Ok;
+}
+
+/* Run the plugin callback 'cb', registered by 'plugin', within its budget,
+ * recording its latency. 'kind' (PROF_*) and 'id' tell what triggered it. */
+ForthEvalResult editorRunCallback(ForthObject *cb, int kind, int id, int plugin)
+{
+    int prev_plugin = CurrentPlugin;
+    uint64_t start = ustime();
+
+    CurrentPlugin = plugin;
+    ForthEvalResult res = ForthInterpreter__eval_budgeted(F, cb, KILO_CB_MAX_STEPS, KILO_CB_MAX_MS);
+    CurrentPlugin = prev_plugin;
+
+    profRecord(kind, id, ustime() - start);
+    if (res == BudgetExceeded)
+        editorSetStatusMessage("Plugin %s %d callback aborted: over its time budget",
+                               ProfKindNames[kind], id);
+    return res;
+}
+
+void *timeoutHandler(void *arg);
+
+/* Register the callback 'obj' to run in 'delay_ms' milliseconds and then,
+ * if 'period_ms' is not zero, every 'period_ms' milliseconds. Returns the
+ * timer handle. */
+int timerAdd(int delay_ms, int period_ms, ForthObject *obj)
+{
+    struct timerEntry e;
+    struct timerCallback *cb;
+
+    if (delay_ms < 0)
+        delay_ms = 0;
+    e.deadline = ustime() + (uint64_t)delay_ms * 1000;
+    e.period = (uint64_t)period_ms * 1000;
+    e.queued = 0;
+
+    pthread_mutex_lock(&Timers.lock);
+    e.id = ++Timers.next_id;
+
+    Timers.callbacks = realloc(Timers.callbacks,
+                               sizeof(struct timerCallback) * (Timers.numcallbacks + 1));
+    cb = &Timers.callbacks[Timers.numcallbacks++];
+    cb->id = e.id;
+    cb->periodic = period_ms != 0;
+    cb->plugin = CurrentPlugin;
+    cb->cb_obj = obj;
+
+    timerHeapPush(&Timers.heap, &e);
+    if (Timers.heap.entries[0].id == e.id)
+        pthread_cond_signal(&Timers.cond);
+    if (!Timers.started && !E.batch) {
+        pthread_t timeout_thread;
+        if (pthread_create(&timeout_thread, NULL, timeoutHandler, NULL) == 0)
+            Timers.started = 1;
+    }
+    pthread_mutex_unlock(&Timers.lock);
+
+    return e.id;
+}
+
+/* Remove the callback of timer 'id'. Returns 1 if it existed, else 0. */
+int timerForget(int id)
+{
+    for (int i = 0; i < Timers.numcallbacks; i++) {
+        if (Timers.callbacks[i].id == id) {
+            ForthObject__drop(Timers.callbacks[i].cb_obj);
+            Timers.callbacks[i] = Timers.callbacks[--Timers.numcallbacks];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Cancel the timer with handle 'id'. Returns 1 if it existed, else 0.
+ * A message already posted for it finds no callback, and is ignored. */
+int timerCancel(int id)
+{
+    pthread_mutex_lock(&Timers.lock);
+    for (int i = 0; i < Timers.heap.len; i++) {
+        if (Timers.heap.entries[i].id == id) {
+            timerHeapRemove(&Timers.heap, i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&Timers.lock);
+
+    return timerForget(id);
+}
+
+/* Run the callback of timer 'id', that the timer thread found due. */
+void timerRun(int id)
+{
+    ForthObject *cb_obj = NULL;
+    int periodic = 0, plugin = -1;
+
+    for (int i = 0; i < Timers.numcallbacks; i++) {
+        if (Timers.callbacks[i].id == id) {
+            // the callback may cancel its own timer
+            cb_obj = ForthObject__rc_clone(Timers.callbacks[i].cb_obj);
+            periodic = Timers.callbacks[i].periodic;
+            plugin = Timers.callbacks[i].plugin;
+            break;
+        }
+    }
+    if (!cb_obj) return;
+
+    ForthEvalResult res = editorRunCallback(cb_obj, PROF_TIMER, id, plugin);
+    if (res != Ok) {
+        fprintf(stderr, "Error: onTimeout callback exited with %d\n", res);
+    }
+    ForthObject__drop(cb_obj);
+
+    if (!periodic) {
+        timerForget(id);
         return;
     }
+    pthread_mutex_lock(&Timers.lock);
+    for (int i = 0; i < Timers.heap.len; i++) {
+        if (Timers.heap.entries[i].id == id) {
+            Timers.heap.entries[i].queued = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&Timers.lock);
+}
+
+// forth builtin: kilo_spawn, kilo_job_stats
+// e.g.: [0 kilo_get_row len] [kilo_set_status_msg] kilo_spawn pop
+/* Jobs run in a pool of worker threads, each with an interpreter of its
+ * own that knows the builtins, but not what the plugins defined. They can
+ * read the rows, as they were when the job was spawned, with kilo_get_row
+ * and kilo_get_numrows, but can't touch the editor. The value a job leaves
+ * on the stack is handed to its 'on_done' callback in the main thread. */
+#define KILO_JOB_THREADS 2
+#define KILO_JOB_STATS 16   /* Finished jobs kept for kilo_job_stats. */
+
+/* An immutable copy of the rows, shared by all the jobs spawned while
+ * E.version stays the same. */
+struct bufSnapshot {
+    atomic_int refcount;
+    int version;
+    int numrows;
+    char **rows;
+    int *sizes;
+};
+
+struct job {
+    int id;
+    int plugin;                 /* Owner of on_done. */
+    ForthObject *code;          /* Deep copy, owned by the worker. */
+    ForthObject *on_done;       /* Main thread only. */
+    ForthObject *result;        /* Deep copy of the value left, or NULL. */
+    ForthEvalResult res;
+    struct bufSnapshot *snap;
+    uint64_t spawned, started, finished;    /* ustime() */
+    struct job *next;
+};
+
+struct jobStat {
+    int id;
+    double queued_ms;
+    double run_ms;
+};
 
-    fprintf(stderr, "Info: Starting timeout handler thread with %d states, delta %d ms\n",
-            schedule->n_states, schedule->delta_ms);
-    int state = 0;
+struct jobPool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct job *head, *tail;    /* Waiting for a worker. */
+    int workers;
+
+    /* Main thread only. */
+    int next_id;
+    int pending;                /* Spawned, whose on_done didn't run yet. */
+    struct bufSnapshot *snap;   /* Last snapshot taken. */
+    struct jobStat stats[KILO_JOB_STATS];
+    int numstats;               /* Jobs finished so far. */
+};
+
+static struct jobPool Jobs = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                               .cond = PTHREAD_COND_INITIALIZER };
+static _Thread_local struct bufSnapshot *JobSnapshot;
+
+void snapshotRelease(struct bufSnapshot *snap)
+{
+    if (atomic_fetch_sub(&snap->refcount, 1) != 1) return;
+    for (int i = 0; i < snap->numrows; i++) free(snap->rows[i]);
+    free(snap->rows);
+    free(snap->sizes);
+    free(snap);
+}
+
+/* Return a snapshot of the rows, copied only if they changed since the
+ * last one. */
+struct bufSnapshot *snapshotTake(void)
+{
+    struct bufSnapshot *snap = Jobs.snap;
+
+    if (snap && snap->version == E.version) {
+        atomic_fetch_add(&snap->refcount, 1);
+        return snap;
+    }
+    if (snap) snapshotRelease(snap);
+
+    snap = malloc(sizeof(*snap));
+    atomic_init(&snap->refcount, 2);    /* Jobs.snap and the caller. */
+    snap->version = E.version;
+    snap->numrows = E.numrows;
+    snap->rows = malloc(sizeof(char*) * (E.numrows ? E.numrows : 1));
+    snap->sizes = malloc(sizeof(int) * (E.numrows ? E.numrows : 1));
+    for (int i = 0; i < E.numrows; i++) {
+        snap->rows[i] = malloc(E.row[i].size ? E.row[i].size : 1);
+        memcpy(snap->rows[i], E.row[i].chars, E.row[i].size);
+        snap->sizes[i] = E.row[i].size;
+    }
+    Jobs.snap = snap;
+    return snap;
+}
+
+// kilo_get_row of the worker interpreters
+ForthEvalResult jobGetRow(ForthInterpreter *f) {
+    ForthObject *idx_arg = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 1, &idx_arg, Number);
+    if (args_res != Ok)
+        return args_res;
+
+    int idx = (int)idx_arg->num;
+    ForthObject__drop(idx_arg);
+
+    if (idx < 0 || idx >= JobSnapshot->numrows)
+        return IndexError;
+
+    ForthObject *res = ForthObject__new_string(JobSnapshot->rows[idx], JobSnapshot->sizes[idx]);
+    ForthObject__list_push_move(f->stack, res);
+
+    return Ok;
+}
+
+// kilo_get_numrows of the worker interpreters
+ForthEvalResult jobGetNumRows(ForthInterpreter *f) {
+    ForthObject *numrows = ForthObject__new_number((double)JobSnapshot->numrows);
+    ForthObject__list_push_move(f->stack, numrows);
+
+    return Ok;
+}
+
+void *jobWorker(void *arg) {
+    (void)arg;
+    ForthInterpreter *w = ForthInterpreter__new(true);
+    ForthInterpreter__register_function(w, "kilo_get_row", jobGetRow);
+    ForthInterpreter__register_function(w, "kilo_get_numrows", jobGetNumRows);
 
     while (1) {
-        usleep(schedule->delta_ms * 1000);
-
-        if (schedule->callbacks[state]) {
-            for (int i = 0; schedule->callbacks[state][i] != NULL; i++) {
-                ForthObject *cb_obj = schedule->callbacks[state][i];
-                ForthEvalResult res = ForthInterpreter__eval_every(F, cb_obj);
-                if (res != Ok) {
-                    fprintf(stderr, "Error: onTimeout callback exited with %d\n", res);
-                }
+        pthread_mutex_lock(&Jobs.lock);
+        while (Jobs.head == NULL)
+            pthread_cond_wait(&Jobs.cond, &Jobs.lock);
+        struct job *job = Jobs.head;
+        Jobs.head = job->next;
+        if (Jobs.head == NULL) Jobs.tail = NULL;
+        pthread_mutex_unlock(&Jobs.lock);
+
+        JobSnapshot = job->snap;
+        job->started = ustime();
+        job->res = ForthInterpreter__eval_budgeted(w, job->code, 0, KILO_JOB_MAX_MS);
+
+        // the result may share objects with the code, or with the
+        // worker symbols: hand a copy of its own to the main thread
+        job->result = NULL;
+        if (job->res == Ok && w->stack->list.len) {
+            ForthObject *top = ForthObject__list_pop(w->stack);
+            job->result = ForthObject__deep_clone(top);
+            ForthObject__drop(top);
+        }
+        while (w->stack->list.len)
+            ForthObject__drop(ForthObject__list_pop(w->stack));
+        ForthObject__drop(job->code);
+        job->code = NULL;
+        snapshotRelease(job->snap);
+        job->snap = JobSnapshot = NULL;
+        job->finished = ustime();
+
+        loopPost(LOOP_MSG_JOB, job->id, job);
+    }
+
+    return NULL;
+}
+
+/* Queue 'code' to run in a worker, and 'on_done' (may be NULL) to be
+ * called with its result. Returns the job id. */
+int jobSpawn(ForthObject *code, ForthObject *on_done)
+{
+    struct job *job = calloc(1, sizeof(*job));
+
+    job->id = ++Jobs.next_id;
+    job->plugin = CurrentPlugin;
+    job->code = ForthObject__deep_clone(code);
+    job->on_done = on_done;
+    job->snap = snapshotTake();
+    job->spawned = ustime();
+    Jobs.pending++;
+
+    pthread_mutex_lock(&Jobs.lock);
+    if (Jobs.tail) Jobs.tail->next = job;
+    else Jobs.head = job;
+    Jobs.tail = job;
+    while (Jobs.workers < KILO_JOB_THREADS) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, jobWorker, NULL) != 0) break;
+        pthread_detach(worker);
+        Jobs.workers++;
+    }
+    pthread_cond_signal(&Jobs.cond);
+    pthread_mutex_unlock(&Jobs.lock);
+
+    return job->id;
+}
+
+/* A job finished: record its timings, and call its on_done callback
+ * with the result on the stack. */
+void jobDone(struct job *job)
+{
+    struct jobStat *st = &Jobs.stats[Jobs.numstats++ % KILO_JOB_STATS];
+
+    Jobs.pending--;
+    st->id = job->id;
+    st->queued_ms = (job->started - job->spawned) / 1000.0;
+    st->run_ms = (job->finished - job->started) / 1000.0;
+    if (E.batch)
+        fprintf(stderr, "Info: job %d ran in %.3f ms (queued for %.3f ms)\n",
+                st->id, st->run_ms, st->queued_ms);
+
+    if (job->res != Ok) {
+        fprintf(stderr, "Error: job %d exited with %d\n", job->id, job->res);
+    } else if (job->on_done) {
+        if (job->result) {
+            ForthObject__list_push_move(F->stack, job->result);
+            job->result = NULL;
+        }
+        // all the jobs share a histogram: ids are never reused
+        ForthEvalResult res = editorRunCallback(job->on_done, PROF_JOB, 0, job->plugin);
+        if (res != Ok)
+            fprintf(stderr, "Error: job %d callback exited with %d\n", job->id, res);
+    }
+    if (job->result) ForthObject__drop(job->result);
+    if (job->on_done) ForthObject__drop(job->on_done);
+    free(job);
+}
+
+// [code] [on_done] kilo_spawn -> job id
+ForthEvalResult kiloSpawn(ForthInterpreter *f) {
+    ForthObject *code = NULL, *on_done = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 2, &on_done, Symbol | List, &code, List);
+    if (args_res != Ok)
+        return args_res;
+
+    int id = jobSpawn(code, on_done);
+    ForthObject__drop(code);
+    ForthObject__list_push_move(f->stack, ForthObject__new_number(id));
+
+    return Ok;
+}
+
+// kilo_job_stats -> [[id queued_ms run_ms] ...] of the last jobs, oldest first
+ForthEvalResult kiloJobStats(ForthInterpreter *f) {
+    int n = Jobs.numstats < KILO_JOB_STATS ? Jobs.numstats : KILO_JOB_STATS;
+    ForthObject *stats = ForthObject__new_list(n ? n : 1, false);
+
+    for (int i = Jobs.numstats - n; i < Jobs.numstats; i++) {
+        struct jobStat *st = &Jobs.stats[i % KILO_JOB_STATS];
+        ForthObject *entry = ForthObject__new_list(3, false);
+        ForthObject__list_push_move(entry, ForthObject__new_number(st->id));
+        ForthObject__list_push_move(entry, ForthObject__new_number(st->queued_ms));
+        ForthObject__list_push_move(entry, ForthObject__new_number(st->run_ms));
+        ForthObject__list_push_move(stats, entry);
+    }
+    ForthObject__list_push_move(f->stack, stats);
+
+    return Ok;
+}
+
+void editorPluginChanged(char *path, int exists);
+
+/* Handle the messages posted to the main loop. Returns 1 if any, so that
+ * the screen is refreshed. */
+int editorLoopDrain(void)
+{
+    struct loopMsg *msg;
+    uint64_t count;
+    int handled = 0;
+
+    if (read(Loop.efd, &count, sizeof(count)) == -1) {
+        /* Nothing posted since the last drain. */
+    }
+    while ((msg = loopQueuePop()) != NULL) {
+        if (msg->type == LOOP_MSG_TIMER)
+            timerRun(msg->id);
+        else if (msg->type == LOOP_MSG_JOB)
+            jobDone(msg->data);
+        else if (msg->type == LOOP_MSG_PLUGIN)
+            editorPluginChanged(msg->data, msg->id);
+        free(msg);
+        handled = 1;
+    }
+    return handled;
+}
+
+/* Without a terminal there is no main loop: wait here for the jobs, and
+ * the jobs their callbacks may spawn, to be done. */
+void editorJobsWait(void)
+{
+    while (Jobs.pending) {
+        struct pollfd pfd = {Loop.efd, POLLIN, 0};
+        poll(&pfd, 1, -1);
+        editorLoopDrain();
+    }
+}
+
+// periodic: 1000 [kilo_save] kilo_ontimeout -> handle
+ForthEvalResult kiloOnTimeout(ForthInterpreter *f) {
+    ForthObject *obj = NULL, *timeout = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 2, &obj, Symbol | List, &timeout, Number);
+    if (args_res != Ok)
+        return args_res;
+
+    int t = (int)timeout->num;
+    ForthObject__drop(timeout);
+    if (t < 1)
+        t = 1;
+
+    int id = timerAdd(t, t, obj);
+    fprintf(stderr, "Info: Registered callback on timeout: %d ms\n", t);
+    ForthObject__list_push_move(f->stack, ForthObject__new_number(id));
+
+    return Ok;
+}
+
+// one shot: 2000 [kilo_save] kilo_after -> handle
+ForthEvalResult kiloAfter(ForthInterpreter *f) {
+    ForthObject *obj = NULL, *timeout = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 2, &obj, Symbol | List, &timeout, Number);
+    if (args_res != Ok)
+        return args_res;
+
+    int t = (int)timeout->num;
+    ForthObject__drop(timeout);
+
+    int id = timerAdd(t, 0, obj);
+    ForthObject__list_push_move(f->stack, ForthObject__new_number(id));
+
+    return Ok;
+}
+
+// cancelling a timer that already fired (or a bogus handle) does nothing
+ForthEvalResult kiloCancelTimer(ForthInterpreter *f) {
+    ForthObject *id = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 1, &id, Number);
+    if (args_res != Ok)
+        return args_res;
+
+    timerCancel((int)id->num);
+    ForthObject__drop(id);
+
+    return Ok;
+}
+
+ForthEvalResult kiloOnIdle(ForthInterpreter *f) {
+    ForthObject *obj = NULL, *quiet = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 2, &obj, Symbol | List, &quiet, Number);
+    if (args_res != Ok)
+        return args_res;
+
+    int q = (int)quiet->num;
+    ForthObject__drop(quiet);
+
+    if (!E.callbacks) {
+        E.callbacks = calloc(1, sizeof(*E.callbacks));
+    }
+
+    int newlen = E.callbacks->onIdleCallbacksLen + 1;
+    struct onIdleCallback *newarr = realloc(E.callbacks->onIdleCallbacks,
+                                            sizeof(struct onIdleCallback) * newlen);
+    if (!newarr) {
+        // out of memory!
+        ForthObject__drop(obj);
+        return Ok;
+    }
+    E.callbacks->onIdleCallbacks = newarr;
+    E.callbacks->onIdleCallbacksLen = newlen;
+
+    E.callbacks->onIdleCallbacks[newlen - 1].quiet_ms = q < 0 ? 0 : q;
+    E.callbacks->onIdleCallbacks[newlen - 1].state = IDLE_ARMED;
+    E.callbacks->onIdleCallbacks[newlen - 1].plugin = CurrentPlugin;
+    E.callbacks->onIdleCallbacks[newlen - 1].cb_obj = obj;
+    fprintf(stderr, "Info: Registered callback on idle: %d ms\n", q);
+
+    return Ok;
+}
+
+/* Time of the last keystroke, and end of the time slice of the idle
+ * callback running, both in microseconds. */
+static uint64_t IdleLastInput;
+static uint64_t IdleSliceEnd;
+
+#define KILO_IDLE_SLICE_MS 10       /* Time slice of an idle callback. */
+#define KILO_IDLE_REFRESH_MS 100    /* Max refresh rate while working. */
+
+// milliseconds left in the slice: 0 kilo_idle_left > [...] while
+ForthEvalResult kiloIdleLeft(ForthInterpreter *f) {
+    uint64_t now = ustime();
+    double left = IdleSliceEnd > now ? (IdleSliceEnd - now) / 1000.0 : 0;
+
+    ForthObject__list_push_move(f->stack, ForthObject__new_number(left));
+
+    return Ok;
+}
+
+/* A key was typed: callbacks done with the previous idle period can run
+ * again in the next one. */
+void editorIdleInput(void) {
+    IdleLastInput = ustime();
+    if (!E.callbacks) return;
+    for (int i = 0; i < E.callbacks->onIdleCallbacksLen; i++) {
+        struct onIdleCallback *cb = &E.callbacks->onIdleCallbacks[i];
+        if (cb->state == IDLE_DONE) cb->state = IDLE_ARMED;
+    }
+}
+
+/* Return how many milliseconds the editor loop can wait for input before
+ * an idle callback is due, or -1 if none is waiting to run. */
+int editorIdleTimeout(void) {
+    int timeout = -1;
+    uint64_t now = ustime();
+
+    if (!E.callbacks) return -1;
+    for (int i = 0; i < E.callbacks->onIdleCallbacksLen; i++) {
+        struct onIdleCallback *cb = &E.callbacks->onIdleCallbacks[i];
+        if (cb->state == IDLE_DONE) continue;
+
+        uint64_t due = IdleLastInput + (uint64_t)cb->quiet_ms * 1000;
+        int ms = due > now ? (int)((due - now + 999) / 1000) : 0;
+        if (timeout == -1 || ms < timeout) timeout = ms;
+    }
+    return timeout;
+}
+
+/* Give a time slice to every idle callback that is due, stopping as soon
+ * as a key is typed on 'fd'. Returns 1 if the screen should be refreshed:
+ * once all the work is done, and every KILO_IDLE_REFRESH_MS meanwhile. */
+int editorIdleRun(int fd) {
+    static uint64_t last_refresh;
+    int ran = 0, working = 0;
+    uint64_t now = ustime();
+
+    if (!E.callbacks) return 0;
+    for (int i = 0; i < E.callbacks->onIdleCallbacksLen; i++) {
+        struct onIdleCallback *cb = &E.callbacks->onIdleCallbacks[i];
+        if (cb->state == IDLE_DONE) continue;
+        if (now - IdleLastInput < (uint64_t)cb->quiet_ms * 1000) continue;
+
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd,1,0) > 0) break;
+
+        // the callback may register idle callbacks, moving the array, or
+        // get its plugin unloaded: hold it, and look it up again after
+        ForthObject *cb_obj = ForthObject__rc_clone(cb->cb_obj);
+        size_t stack_len = F->stack->list.len;
+        IdleSliceEnd = ustime() + KILO_IDLE_SLICE_MS * 1000;
+        ForthEvalResult res = editorRunCallback(cb_obj, PROF_IDLE, i, cb->plugin);
+        if (res != Ok)
+            fprintf(stderr, "Error: onIdle callback exited with %d\n", res);
+        now = ustime();
+        ran = 1;
+
+        // a nonzero number left on the stack asks for another slice
+        int state = IDLE_DONE;
+        if (res == Ok && F->stack->list.len > stack_len) {
+            ForthObject *more = ForthObject__list_pop(F->stack);
+            if (more->type == Number && more->num != 0)
+                state = IDLE_WORKING;
+            ForthObject__drop(more);
+        }
+        if (i < E.callbacks->onIdleCallbacksLen &&
+            E.callbacks->onIdleCallbacks[i].cb_obj == cb_obj) {
+            E.callbacks->onIdleCallbacks[i].state = state;
+            if (state == IDLE_WORKING) working = 1;
+        }
+        ForthObject__drop(cb_obj);
+    }
+
+    if (!ran) return 0;
+    if (working && now - last_refresh < KILO_IDLE_REFRESH_MS * 1000)
+        return 0;
+    last_refresh = now;
+    return 1;
+}
+
+ForthEvalResult kiloOnKey(ForthInterpreter *f) {
+    ForthObject *obj = NULL, *key = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 2, &obj, Symbol | List, &key, Number | String);
+    if (args_res != Ok)
+        return args_res;
+
+    int k = key->type == Number ? (int)key->num : (int)*key->string.chars;
+    ForthObject__drop(key);
+
+    if (!E.callbacks) {
+        E.callbacks = calloc(1, sizeof(*E.callbacks));
+    }
+
+    int newlen = E.callbacks->onKeyCallbacksLen + 1;
+    struct onKeyCallback *newarr = realloc(E.callbacks->onKeyCallbacks,
+                                           sizeof(struct onKeyCallback) * newlen);
+    if (!newarr) {
+        // out of memory!
+        ForthObject__drop(obj);
+        return Ok;
+    }
+    E.callbacks->onKeyCallbacks = newarr;
+    E.callbacks->onKeyCallbacksLen = newlen;
+
+    E.callbacks->onKeyCallbacks[newlen - 1].key = k;
+    E.callbacks->onKeyCallbacks[newlen - 1].plugin = CurrentPlugin;
+    E.callbacks->onKeyCallbacks[newlen - 1].cb_obj = obj;
+    fprintf(stderr, "Info: Registered callback on key: %d\n", k);
+
+    return Ok;
+}
+
+void *timeoutHandler(void *arg) {
+    (void)arg;
+
+    fprintf(stderr, "Info: Starting timeout handler thread\n");
+
+    pthread_mutex_lock(&Timers.lock);
+    while (1) {
+        uint64_t now = ustime();
+
+        if (Timers.heap.len == 0) {
+            pthread_cond_wait(&Timers.cond, &Timers.lock);
+            continue;
+        }
+        struct timerEntry *e = &Timers.heap.entries[0];
+        if (e->deadline > now) {
+            struct timespec ts;
+            ts.tv_sec = e->deadline / 1000000;
+            ts.tv_nsec = (e->deadline % 1000000) * 1000;
+            pthread_cond_timedwait(&Timers.cond, &Timers.lock, &ts);
+            continue;
+        }
+
+        // a periodic timer whose last run is still queued, because the
+        // main thread is busy, is not posted again: runs are coalesced
+        if (!e->queued)
+            loopPost(LOOP_MSG_TIMER, e->id, NULL);
+        if (e->period) {
+            e->queued = 1;
+            timerAdvance(e, now);
+            timerHeapSiftDown(&Timers.heap, 0);
+        } else {
+            timerHeapRemove(&Timers.heap, 0);
+        }
+    }
+
+    return NULL;
+}
+
+/* Set up the timers lock and condition variable, that waits on the same
+ * clock as the deadlines. */
+void timerSchedulerInit(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_mutex_init(&Timers.lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&Timers.cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/* Return the index of the plugin file 'path' in Plugins, adding it if
+ * new. */
+int editorPluginIndex(const char *path) {
+    for (int i = 0; i < NumPlugins; i++)
+        if (!strcmp(Plugins[i].path, path)) return i;
+
+    Plugins = realloc(Plugins, sizeof(struct pluginFile) * (NumPlugins + 1));
+    memset(&Plugins[NumPlugins], 0, sizeof(struct pluginFile));
+    Plugins[NumPlugins].path = strdup(path);
+    return NumPlugins++;
+}
+
+/* Evaluate the plugin number 'plugin'. */
+void editorRunPlugin(int plugin) {
+    struct pluginFile *p = &Plugins[plugin];
+    int prev_plugin = CurrentPlugin;
+    uint64_t start = ustime();
+
+    fprintf(stderr, "Info: Loading plugin file '%s'\n", p->path);
+    p->loaded = 1;
+    CurrentPlugin = plugin;
+    // loaded on demand from a callback (a timer stub, or a key processed
+    // by kilo_process_key), the file is not subject to its budget: it would
+    // be left half evaluated. Nor does the time spent loading it count.
+    bool had_budget = F->has_budget;
+    size_t steps = F->budget_steps;
+    uint64_t deadline = F->budget_deadline;
+    F->has_budget = false;
+    char *file_path = strdup(p->path);
+    ForthEvalError *errors = ForthInterpreter__run_file(F, file_path);
+    free(errors);
+    free(file_path);
+    F->has_budget = had_budget;
+    F->budget_steps = steps;
+    F->budget_deadline = deadline ? deadline + (ustime()-start)*1000 : 0;
+    CurrentPlugin = prev_plugin;
+    editorTrace("plugin '%s' loaded in %.3f ms", p->path, (ustime()-start)/1000.0);
+}
+
+/* Read the "#! kilo-...:" header lines of the plugin number 'plugin'. If
+ * it declares what it binds, register the stubs that will load it and
+ * return 1, else return 0: the plugin must be loaded now. */
+int editorDeclarePlugin(int plugin) {
+    struct pluginFile *p = &Plugins[plugin];
+    FILE *fp = fopen(p->path, "r");
+    char line[1024];
+    int timer_ms = -1, lazy = 0;
+
+    if (!fp) return 0;
+    free(p->keys);
+    for (int i = 0; i < p->numfiletypes; i++) free(p->filetypes[i]);
+    free(p->filetypes);
+    p->keys = NULL;
+    p->filetypes = NULL;
+    p->numkeys = p->numfiletypes = 0;
+
+    while (fgets(line, sizeof(line), fp) && line[0] == '#') {
+        char *args, *tok, *save;
+        int kind;   /* 'k'eys, 'f'iletypes or 't'imers */
+        if (!strncmp(line, "#! kilo-keys:", 13)) args = line+13, kind = 'k';
+        else if (!strncmp(line, "#! kilo-filetypes:", 18)) args = line+18, kind = 'f';
+        else if (!strncmp(line, "#! kilo-timers:", 15)) args = line+15, kind = 't';
+        else continue;
+
+        lazy = 1;
+        for (tok = strtok_r(args, " \t\r\n", &save); tok;
+             tok = strtok_r(NULL, " \t\r\n", &save))
+        {
+            if (kind == 'k') {
+                p->keys = realloc(p->keys, sizeof(int) * (p->numkeys + 1));
+                p->keys[p->numkeys++] = atoi(tok);
+            } else if (kind == 'f') {
+                p->filetypes = realloc(p->filetypes, sizeof(char*) * (p->numfiletypes + 1));
+                p->filetypes[p->numfiletypes++] = strdup(tok);
+            } else if (timer_ms == -1 || atoi(tok) < timer_ms) {
+                timer_ms = atoi(tok);
             }
+        }
+    }
+    fclose(fp);
+    if (!lazy) return 0;
+
+    // the timer stub is just [ "path" kilo_load_plugin ]
+    if (timer_ms != -1) {
+        ForthObject *stub = ForthObject__new_list(2, false);
+        ForthObject__list_push_move(stub, ForthObject__new_string(p->path, strlen(p->path)));
+        ForthObject__list_push_move(stub, ForthObject__new_symbol("kilo_load_plugin", 16, Unquoted));
+        int prev_plugin = CurrentPlugin;
+        CurrentPlugin = plugin;
+        timerAdd(timer_ms, 0, stub);
+        CurrentPlugin = prev_plugin;
+    }
+    editorTrace("plugin '%s' deferred: %d keys, %d file types, timer %d ms",
+                p->path, p->numkeys, p->numfiletypes, timer_ms);
+    return 1;
+}
+
+/* Load the plugins not loaded yet that bind the key 'c'. */
+void editorLazyKey(int c) {
+    for (int i = 0; i < NumPlugins; i++) {
+        if (Plugins[i].loaded) continue;
+        for (int j = 0; j < Plugins[i].numkeys; j++) {
+            if (Plugins[i].keys[j] == c) {
+                editorRunPlugin(i);
+                break;
+            }
+        }
+    }
+}
+
+/* Load the plugins not loaded yet that handle files like 'filename'. The
+ * file types match like the syntaxes filematch: ".c" matches a suffix,
+ * anything else a substring. */
+void editorLazyFile(char *filename) {
+    for (int i = 0; i < NumPlugins; i++) {
+        if (Plugins[i].loaded) continue;
+        for (int j = 0; j < Plugins[i].numfiletypes; j++) {
+            char *pat = Plugins[i].filetypes[j], *p = strstr(filename, pat);
+            if (p && (pat[0] != '.' || p[strlen(pat)] == '\0')) {
+                editorRunPlugin(i);
+                break;
+            }
+        }
+    }
+}
+
+// forth builtin: kilo_load_plugin
+// e.g.: "/usr/local/share/kilo/plugins/vim.forth" kilo_load_plugin
+ForthEvalResult kiloLoadPlugin(ForthInterpreter *f) {
+    ForthObject *path = NULL;
+    ForthEvalResult args_res = ForthInterpreter__pop_args(f, 1, &path, String);
+    if (args_res != Ok)
+        return args_res;
+
+    char *p = malloc(path->string.len + 1);
+    memcpy(p, path->string.chars, path->string.len);
+    p[path->string.len] = '\0';
+    ForthObject__drop(path);
+
+    int plugin = editorPluginIndex(p);
+    free(p);
+    if (!Plugins[plugin].loaded)
+        editorRunPlugin(plugin);
+
+    return Ok;
+}
+
+/* Load the plugin file 'path', if it is a .forth or .syntax file: plugins
+ * that declare what they bind are only loaded on first use, unless 'now'
+ * is true. Returns 1 if it was loaded or declared, else 0. */
+int editorLoadPlugin(const char *path, int now) {
+    // Check if file has .forth or .syntax extension
+    const char *base = strrchr(path, '/');
+    const char *ext = strrchr(base ? base : path, '.');
+    if (!ext || (strcmp(ext, ".forth") != 0 && strcmp(ext, ".syntax") != 0)) {
+        return 0;
+    }
+
+    // Check if it's a regular file
+    struct stat file_stat;
+    if (stat(path, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        return 0;
+    }
+
+    // Syntax definitions are compiled, not executed
+    if (strcmp(ext, ".syntax") == 0) {
+        fprintf(stderr, "Info: Loading syntax file '%s'\n", path);
+        FILE *fp = fopen(path, "r");
+        if (!fp)
+            return 0;
+        char *text = malloc(file_stat.st_size ? file_stat.st_size : 1);
+        size_t len = fread(text, 1, file_stat.st_size, fp);
+        fclose(fp);
+        struct editorSyntax *s = editorDefineSyntax(text, len, path);
+        free(text);
+        if (s && E.filename && editorSyntaxMatches(s, E.filename))
+            editorSetSyntax(s);
+        return 1;
+    }
 
-            editorRefreshScreen();
+    int plugin = editorPluginIndex(path);
+    if (now || !editorDeclarePlugin(plugin))
+        editorRunPlugin(plugin);
+    return 1;
+}
+
+/* Drop the key, idle, exit callbacks and the timers registered by the
+ * plugin number 'plugin'. */
+void editorUnloadPlugin(int plugin) {
+    int j = 0;
+
+    for (int i = 0; i < Timers.numcallbacks; i++) {
+        if (Timers.callbacks[i].plugin == plugin) {
+            timerCancel(Timers.callbacks[i].id);
+            i--;    // the last one was moved here
         }
+    }
+    if (!E.callbacks) return;
+
+    for (int i = 0; i < E.callbacks->onKeyCallbacksLen; i++) {
+        struct onKeyCallback *cb = &E.callbacks->onKeyCallbacks[i];
+        if (cb->plugin == plugin) ForthObject__drop(cb->cb_obj);
+        else E.callbacks->onKeyCallbacks[j++] = *cb;
+    }
+    E.callbacks->onKeyCallbacksLen = j;
 
-        state = (state + 1) % schedule->n_states;
+    j = 0;
+    for (int i = 0; i < E.callbacks->onIdleCallbacksLen; i++) {
+        struct onIdleCallback *cb = &E.callbacks->onIdleCallbacks[i];
+        if (cb->plugin == plugin) ForthObject__drop(cb->cb_obj);
+        else E.callbacks->onIdleCallbacks[j++] = *cb;
     }
+    E.callbacks->onIdleCallbacksLen = j;
 
-    freeCallbackSchedule(schedule);
+    if (E.callbacks->onExitCallback && E.callbacks->onExitPlugin == plugin) {
+        ForthObject__drop(E.callbacks->onExitCallback);
+        E.callbacks->onExitCallback = NULL;
+    }
+}
+
+/* The plugin file 'path' was written, or removed if 'exists' is 0: drop
+ * what it registered and evaluate it again. Takes ownership of 'path'. */
+void editorPluginChanged(char *path, int exists) {
+    const char *base = strrchr(path, '/');
+    base = base ? base+1 : path;
+
+    int was_loaded = 0;
+    for (int i = 0; i < NumPlugins; i++) {
+        if (!strcmp(Plugins[i].path, path)) {
+            editorUnloadPlugin(i);
+            was_loaded = Plugins[i].loaded;
+            Plugins[i].loaded = 0;
+        }
+    }
+    if (!exists)
+        editorSetStatusMessage("Plugin '%s' unloaded", base);
+    else if (editorLoadPlugin(path, was_loaded))
+        editorSetStatusMessage("Plugin '%s' reloaded", base);
+    free(path);
+}
+
+/* Watch the plugins directory with inotify, in a thread of its own that
+ * posts the files written, moved in or out and removed to the main loop. */
+void *editorPluginWatcher(void *arg) {
+    char *dir = arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int fd = inotify_init1(IN_CLOEXEC);
+
+    if (fd == -1 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO |
+                                      IN_MOVED_FROM | IN_DELETE) == -1) {
+        fprintf(stderr, "Warning: Can't watch plugins directory '%s'\n", dir);
+        return NULL;
+    }
+
+    while (1) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len == -1 && errno == EINTR) continue;
+            break;
+        }
+
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            const char *ext = ev->len ? strrchr(ev->name, '.') : NULL;
+            if (!ext || (strcmp(ext, ".forth") && strcmp(ext, ".syntax")))
+                continue;
+
+            char *path = malloc(strlen(dir) + ev->len + 2);
+            sprintf(path, "%s/%s", dir, ev->name);
+            int exists = !(ev->mask & (IN_MOVED_FROM | IN_DELETE));
+            loopPost(LOOP_MSG_PLUGIN, exists, path);
+        }
+    }
+    close(fd);
+
+    return NULL;
+}
+
+void editorWatchPlugins(const char *dir) {
+    pthread_t watcher;
+
+    if (pthread_create(&watcher, NULL, editorPluginWatcher, strdup(dir)) == 0)
+        pthread_detach(watcher);
 }
 
 void initInterpreter(void) {
+    loopQueueInit();
+    timerSchedulerInit();
+    IdleLastInput = ustime();
     F = ForthInterpreter__new(true);
     ForthInterpreter__register_function(F, "kilo_onkey", kiloOnKey);
     ForthInterpreter__register_function(F, "kilo_onexit", kiloOnExit);
     ForthInterpreter__register_function(F, "kilo_ontimeout", kiloOnTimeout);
+    ForthInterpreter__register_function(F, "kilo_after", kiloAfter);
+    ForthInterpreter__register_function(F, "kilo_cancel_timer", kiloCancelTimer);
+    ForthInterpreter__register_function(F, "kilo_onidle", kiloOnIdle);
+    ForthInterpreter__register_function(F, "kilo_idle_left", kiloIdleLeft);
+    ForthInterpreter__register_function(F, "kilo_spawn", kiloSpawn);
+    ForthInterpreter__register_function(F, "kilo_job_stats", kiloJobStats);
+    ForthInterpreter__register_function(F, "kilo_plugin_stats", kiloPluginStats);
+    ForthInterpreter__register_function(F, "kilo_load_plugin", kiloLoadPlugin);
     ForthInterpreter__register_function(F, "kilo_exit", kiloExit);
     ForthInterpreter__register_function(F, "kilo_save", kiloSave);
     ForthInterpreter__register_function(F, "kilo_set_row", kiloSetRow);
     ForthInterpreter__register_function(F, "kilo_get_row", kiloGetRow);
+    ForthInterpreter__register_function(F, "kilo_get_rows", kiloGetRows);
+    ForthInterpreter__register_function(F, "kilo_set_rows", kiloSetRows);
+    ForthInterpreter__register_function(F, "kilo_insert_rows", kiloInsertRows);
+    ForthInterpreter__register_function(F, "kilo_delete_rows", kiloDeleteRows);
     ForthInterpreter__register_function(F, "kilo_get_numrows", kiloGetNumRows);
     ForthInterpreter__register_function(F, "kilo_get_cx", kiloGetCursorX);
     ForthInterpreter__register_function(F, "kilo_set_cx", kiloSetCursorX);
@@ -534,6 +2200,12 @@ void initInterpreter(void) {
     ForthInterpreter__register_function(F, "kilo_set_status_msg", kiloSetStatusMessage);
     ForthInterpreter__register_function(F, "kilo_process_key", kiloProcessKey);
     ForthInterpreter__register_function(F, "kilo_process_key_rec", kiloProcessKeyRecursive);
+    ForthInterpreter__register_function(F, "kilo_macro_record", kiloMacroRecord);
+    ForthInterpreter__register_function(F, "kilo_macro_play", kiloMacroPlay);
+    ForthInterpreter__register_function(F, "kilo_define_syntax", kiloDefineSyntax);
+    ForthInterpreter__register_function(F, "kilo_find_regex", kiloFindRegex);
+    ForthInterpreter__register_function(F, "kilo_find", kiloFind);
+    ForthInterpreter__register_function(F, "kilo_replace", kiloReplace);
 
     char *plugins_dir = getenv("KILO_PLUGINS_DIR");
     if (!plugins_dir)
@@ -545,44 +2217,34 @@ void initInterpreter(void) {
         return;
     }
 
+    uint64_t start = ustime();
     struct dirent *entry;
     while ((entry = readdir(dir)) != NULL) {
-        // Check if file has .forth extension
-        char *ext = strrchr(entry->d_name, '.');
-        if (!ext || strcmp(ext, ".forth") != 0) {
-            continue;
-        }
-
         // Build full path to the plugin file
         char full_path[1024];
         snprintf(full_path, sizeof(full_path), "%s/%s", plugins_dir, entry->d_name);
-
-        // Check if it's a regular file
-        struct stat file_stat;
-        if (stat(full_path, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
-            continue;
-        }
-
-        // Execute the plugin file
-        fprintf(stderr, "Info: Loading plugin file '%s'\n", full_path);
-        ForthEvalError *errors = ForthInterpreter__run_file(F, full_path);
-        free(errors);
+        editorLoadPlugin(full_path, 0);
     }
 
     closedir(dir);
 
-    if (E.callbacks->onTimeoutCallbacksLen) {
-        pthread_t timeout_thread;
-        pthread_create(&timeout_thread, NULL, (void *)timeoutHandler, NULL);
-    }
+    int loaded = 0;
+    for (int i = 0; i < NumPlugins; i++) loaded += Plugins[i].loaded;
+    editorTrace("plugins initialized in %.3f ms: %d loaded, %d deferred",
+                (ustime()-start)/1000.0, loaded, NumPlugins - loaded);
+
+    if (!E.batch)
+        editorWatchPlugins(plugins_dir);
 }
 
-ForthObject *editorGetOnKeyCallback(int c) {
+ForthObject *editorGetOnKeyCallback(int c, int *plugin) {
     if (!E.callbacks) return NULL;
 
     for (int i = 0; i < E.callbacks->onKeyCallbacksLen; i++) {
-        if (c == E.callbacks->onKeyCallbacks[i].key)
+        if (c == E.callbacks->onKeyCallbacks[i].key) {
+            *plugin = E.callbacks->onKeyCallbacks[i].plugin;
             return E.callbacks->onKeyCallbacks[i].cb_obj;
+        }
     }
 
     return NULL;
@@ -598,9 +2260,13 @@ enum KEY_ACTION{
         TAB = 9,            /* Tab */
         CTRL_L = 12,        /* Ctrl+l */
         ENTER = 13,         /* Enter */
+        CTRL_P = 16,        /* Ctrl-p */
         CTRL_Q = 17,        /* Ctrl-q */
+        CTRL_R = 18,        /* Ctrl-r */
         CTRL_S = 19,        /* Ctrl-s */
         CTRL_U = 21,        /* Ctrl-u */
+        CTRL_W = 23,        /* Ctrl-w */
+        CTRL_Z = 26,        /* Ctrl-z */
         ESC = 27,           /* Escape */
         BACKSPACE =  127,   /* Backspace */
         /* The following are just soft codes, not really reported by the
@@ -634,6 +2300,9 @@ void editorSetStatusMessage(const char *fmt, ...);
  * of strings, and a set of flags in order to enable highlighting of
  * comments and numbers.
  *
+ * When a syntax is selected its keywords are compiled into a perfect hash
+ * table, so the lookup cost does not depend on the number of keywords.
+ *
  * The characters for single and multi line comments must be exactly two
  * and must be provided as well (see the C language example).
  *
@@ -669,7 +2338,8 @@ struct editorSyntax HLDB[] = {
         C_HL_extensions,
         C_HL_keywords,
         "//","/*","*/",
-        HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS
+        HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS,
+        NULL,0,0,NULL,NULL
     }
 };
 
@@ -692,13 +2362,14 @@ void editorAtExit(void) {
     #ifdef PLUGINS_ENABLED
     if (F && E.callbacks && E.callbacks->onExitCallback) {
         ForthObject *cb = E.callbacks->onExitCallback;
-        ForthEvalResult res = ForthInterpreter__eval_every(F, cb);
+        ForthEvalResult res = editorRunCallback(cb, PROF_EXIT, 0, E.callbacks->onExitPlugin);
         fprintf(stderr, "Info: Executed on-exit callback, exited with %d\n", res);
     }
+    if (F && getenv("KILO_PROFILE")) editorProfileDump(getenv("KILO_PROFILE"));
     #endif
 
     disableRawMode(STDIN_FILENO);
-    write(STDOUT_FILENO,"\x1b[1;1H\x1b[J",9);
+    if (!E.batch) write(STDOUT_FILENO,"\x1b[1;1H\x1b[J",9);
 }
 
 /* Raw mode: 1960 magic shit. */
@@ -735,26 +2406,42 @@ fatal:
     return -1;
 }
 
-/* Read a key from the terminal put in raw mode, trying to handle
- * escape sequences. */
-int editorReadKey(int fd) {
-    int nread;
-    char c, seq[3];
-    while ((nread = read(fd,&c,1)) == 0);
-    if (nread == -1) exit(1);
+/* Byte readers for editorDecodeKey(): they store the next input byte at
+ * *c and return 1, or return 0 on timeout or end of input. */
+int fdReadByte(void *ctx, char *c) {
+    return read(*(int*)ctx,c,1) == 1;
+}
+
+struct keyBuffer {
+    const char *buf;    /* Raw keystrokes, as typed on a terminal. */
+    size_t len;         /* Number of bytes in 'buf'. */
+    size_t pos;         /* Next byte to decode. */
+};
+
+int bufReadByte(void *ctx, char *c) {
+    struct keyBuffer *kb = ctx;
+    if (kb->pos == kb->len) return 0;
+    *c = kb->buf[kb->pos++];
+    return 1;
+}
+
+/* Decode a key starting with the already read byte 'c', consuming the rest
+ * of the escape sequence, if any, using 'readbyte'. */
+int editorDecodeKey(int (*readbyte)(void *ctx, char *c), void *ctx, char c) {
+    char seq[3];
 
     while(1) {
         switch(c) {
         case ESC:    /* escape sequence */
             /* If this is just an ESC, we'll timeout here. */
-            if (read(fd,seq,1) == 0) return ESC;
-            if (read(fd,seq+1,1) == 0) return ESC;
+            if (!readbyte(ctx,seq)) return ESC;
+            if (!readbyte(ctx,seq+1)) return ESC;
 
             /* ESC [ sequences. */
             if (seq[0] == '[') {
                 if (seq[1] >= '0' && seq[1] <= '9') {
                     /* Extended escape, read additional byte. */
-                    if (read(fd,seq+2,1) == 0) return ESC;
+                    if (!readbyte(ctx,seq+2)) return ESC;
                     if (seq[2] == '~') {
                         switch(seq[1]) {
                         case '3': return DEL_KEY;
@@ -788,6 +2475,48 @@ int editorReadKey(int fd) {
     }
 }
 
+int editorHighlightDrain(void);
+int editorTrigramDrain(void);
+void editorRefreshScreen(void);
+
+/* Read a key from the terminal put in raw mode, trying to handle
+ * escape sequences. */
+int editorReadKey(int fd) {
+    int nread;
+    char c;
+    while (1) {
+        /* Wait for input no longer than the next idle callback, and
+         * anyway no more than the 100 ms of the read() timeout. */
+        int timeout = 100;
+#ifdef PLUGINS_ENABLED
+        int idle = editorIdleTimeout();
+        if (idle != -1 && idle < timeout) timeout = idle;
+#endif
+        /* The second fd wakes us up when other threads post messages
+         * to the main loop (poll() ignores it if negative). */
+        struct pollfd pfd[2] = {{fd, POLLIN, 0}, {-1, POLLIN, 0}};
+#ifdef PLUGINS_ENABLED
+        pfd[1].fd = Loop.efd;
+#endif
+        if (poll(pfd,2,timeout) > 0 && (pfd[0].revents & POLLIN) &&
+            (nread = read(fd,&c,1)) != 0) break;
+
+        /* Nothing typed: time to show what was highlighted in background,
+         * and to install the trigram index once built. */
+        int refresh = editorHighlightDrain() | editorTrigramDrain();
+#ifdef PLUGINS_ENABLED
+        refresh |= editorLoopDrain();
+        refresh |= editorIdleRun(fd);
+#endif
+        if (refresh) editorRefreshScreen();
+    }
+    if (nread == -1) exit(1);
+#ifdef PLUGINS_ENABLED
+    editorIdleInput();
+#endif
+    return editorDecodeKey(fdReadByte,&fd,c);
+}
+
 /* Use the ESC [6n escape sequence to query the horizontal cursor position
  * and return it. On error -1 is returned, on success the position of the
  * cursor is stored at *rows and *cols and 0 is returned. */
@@ -850,64 +2579,726 @@ failed:
 
 /* ====================== Syntax highlight color scheme  ==================== */
 
+/* Character classes used by the highlighter, see editorInitCharClasses(). */
+#define HLC_SEP   (1<<0)    /* Separator, see is_separator(). */
+#define HLC_SPACE (1<<1)    /* isspace() */
+#define HLC_DIGIT (1<<2)    /* isdigit() */
+#define HLC_PRINT (1<<3)    /* isprint() */
+#define HLC_WORD  (1<<4)    /* Identifier char: [A-Za-z0-9_] */
+
+static unsigned char hlclass[256];
+
+/* Classify every byte once, so that the highlighter does a table lookup
+ * instead of calling a bunch of <ctype.h> functions and strchr(). */
+void editorInitCharClasses(void) {
+    for (int c = 0; c < 256; c++) {
+        unsigned char cl = 0;
+        if (c == '\0' || isspace(c) || strchr(",.()+-/*=~%[];",c) != NULL)
+            cl |= HLC_SEP;
+        if (isspace(c)) cl |= HLC_SPACE;
+        if (isdigit(c)) cl |= HLC_DIGIT;
+        if (isprint(c)) cl |= HLC_PRINT;
+        if (isalnum(c) || c == '_') cl |= HLC_WORD;
+        hlclass[c] = cl;
+    }
+}
+
+#define HLCLASS(c) hlclass[(unsigned char)(c)]
+
 int is_separator(int c) {
-    return c == '\0' || isspace(c) || strchr(",.()+-/*=~%[];",c) != NULL;
+    return HLCLASS(c) & HLC_SEP;
+}
+
+/* The following functions let the highlighter skip in one go over the runs
+ * of bytes that can't change its state: identifiers, blanks, the body of
+ * comments and strings. With SSE2 they classify 16 bytes at a time,
+ * otherwise they fall back to a scalar loop. Most runs are short, so the
+ * first HL_SCALAR_PREFIX bytes are always checked one by one, which is
+ * cheaper than setting up the vector compares. All of them scan at most
+ * 'len' bytes. */
+#define HL_SCALAR_PREFIX 8
+
+/* Return the length of the run of identifier chars at the start of 'p'. */
+int hlSpanWord(const char *p, int len) {
+    int j = 0;
+    while(j < len && j < HL_SCALAR_PREFIX) {
+        if (!(HLCLASS(p[j]) & HLC_WORD)) return j;
+        j++;
+    }
+#if defined(__SSE2__)
+    const __m128i lower_a = _mm_set1_epi8('a'-1), lower_z = _mm_set1_epi8('z'+1);
+    const __m128i digit_0 = _mm_set1_epi8('0'-1), digit_9 = _mm_set1_epi8('9'+1);
+    const __m128i case_bit = _mm_set1_epi8(0x20), underscore = _mm_set1_epi8('_');
+    for (; j+16 <= len; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p+j));
+        /* Bytes >= 128 are negative, so they never fall in the ranges. */
+        __m128i folded = _mm_or_si128(v,case_bit);
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(folded,lower_a),
+                                      _mm_cmplt_epi8(folded,lower_z));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v,digit_0),
+                                      _mm_cmplt_epi8(v,digit_9));
+        __m128i word = _mm_or_si128(_mm_or_si128(alpha,digit),
+                                    _mm_cmpeq_epi8(v,underscore));
+        unsigned int mask = _mm_movemask_epi8(word);
+        if (mask != 0xffff) return j+__builtin_ctz(~mask);
+    }
+#endif
+    while(j < len && (HLCLASS(p[j]) & HLC_WORD)) j++;
+    return j;
+}
+
+/* Return the length of the run of 'c' bytes at the start of 'p'. */
+int hlSpanByte(const char *p, int len, int c) {
+    int j = 0;
+    while(j < len && j < HL_SCALAR_PREFIX) {
+        if (p[j] != c) return j;
+        j++;
+    }
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi8(c);
+    for (; j+16 <= len; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p+j));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v,needle));
+        if (mask != 0xffff) return j+__builtin_ctz(~mask);
+    }
+#endif
+    while(j < len && p[j] == c) j++;
+    return j;
+}
+
+/* Return the offset of the first byte of 'p' that is 'a', 'b' or 'c', or
+ * 'len' if there is none. */
+int hlFind3(const char *p, int len, int a, int b, int c) {
+    int j = 0;
+    while(j < len && j < HL_SCALAR_PREFIX) {
+        if (p[j] == a || p[j] == b || p[j] == c) return j;
+        j++;
+    }
+#if defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b),
+                  vc = _mm_set1_epi8(c);
+    for (; j+16 <= len; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p+j));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,va),
+                                                _mm_cmpeq_epi8(v,vb)),
+                                   _mm_cmpeq_epi8(v,vc));
+        unsigned int mask = _mm_movemask_epi8(hit);
+        if (mask) return j+__builtin_ctz(mask);
+    }
+#endif
+    while(j < len && p[j] != a && p[j] != b && p[j] != c) j++;
+    return j;
+}
+
+/* Hash a word for the keywords table. This is FNV-1a, with the seed mixed
+ * in the initial state so that we can look for a seed that maps all the
+ * keywords of a syntax to different slots. */
+uint32_t editorKeywordHash(uint32_t seed, const char *p, int len) {
+    uint32_t h = 2166136261u ^ seed;
+    for (int j = 0; j < len; j++) {
+        h ^= (unsigned char)p[j];
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+/* Compile the keywords list of the syntax into a perfect hash table, so that
+ * editorSyntaxKeyword() can tell if a word is a keyword with a single probe.
+ * We try seeds until every keyword lands in a different slot, doubling the
+ * table size from time to time if we are unlucky. */
+void editorSyntaxCompile(struct editorSyntax *s) {
+    int count = 0, j;
+
+    if (s->kwtable) return; /* Already compiled. */
+    while(s->keywords[count]) count++;
+
+    unsigned int size = 16;
+    while(size < (unsigned int)count*2) size *= 2;
+    for (uint32_t seed = 0; ; seed++) {
+        if (seed && seed % 256 == 0) size *= 2;
+        struct editorKeyword *table = calloc(size,sizeof(*table));
+        for (j = 0; j < count; j++) {
+            char *word = s->keywords[j];
+            int len = strlen(word);
+            int hl = HL_KEYWORD1;
+            if (len && word[len-1] == '|') {
+                len--;
+                hl = HL_KEYWORD2;
+            }
+            struct editorKeyword *slot =
+                table+(editorKeywordHash(seed,word,len) & (size-1));
+            if (slot->word) {
+                /* The same keyword may appear twice, like "auto" in the
+                 * C list: the first entry wins, as it used to. */
+                if (slot->len == len && !memcmp(slot->word,word,len))
+                    continue;
+                break;  /* Collision. */
+            }
+            slot->word = word;
+            slot->len = len;
+            slot->hl = hl;
+        }
+        if (j == count) {
+            s->kwtable = table;
+            s->kwmask = size-1;
+            s->kwseed = seed;
+            return;
+        }
+        free(table);
+    }
+}
+
+/* Return the highlight type of the word 'p' of length 'len' if it is a
+ * keyword, otherwise zero (HL_NORMAL). */
+int editorSyntaxKeyword(struct editorSyntax *s, const char *p, int len) {
+    struct editorKeyword *slot =
+        s->kwtable+(editorKeywordHash(s->kwseed,p,len) & s->kwmask);
+    if (slot->word && slot->len == len && !memcmp(slot->word,p,len))
+        return slot->hl;
+    return HL_NORMAL;
+}
+
+/* ====================== Data driven syntax definitions ==================== */
+
+/* Besides the built-in HLDB entries, syntax definitions can be loaded at run
+ * time, from *.syntax files in the plugins directory or with the
+ * kilo_define_syntax builtin. A definition is made of lines like these:
+ *
+ *   syntax forth
+ *   filematch .forth .fs
+ *   keywords define if ifelse times
+ *   types kilo_onkey kilo_set_row
+ *   comment #
+ *   mlcomment ( )
+ *   strings "'
+ *   escape none
+ *   numbers
+ *   separators ,.()[];
+ *
+ * "types" are highlighted as the second kind of keywords. Without an
+ * "escape" line, backslash escapes the next byte in strings. Lines starting
+ * with '#' are ignored, and \xHH, \s and \\ can be used in the words to
+ * write bytes that would be a problem otherwise, like a double quote in a
+ * Forth string.
+ *
+ * A definition is compiled into a DFA: the lexer rules in lexStep() are run
+ * once for every reachable state and class of bytes, and the results are
+ * stored in a transition table. Highlighting a row is then a single loop of
+ * table lookups, see editorHighlightDFA(). Keywords are only looked up when
+ * a word ends, in the same hash table used by the built-in syntaxes. */
+
+#define DFA_MAX_DELIM 4         /* Max length of a comment delimiter. */
+#define DFA_MAX_STATES 4096
+#define DFA_WORD_START (1<<0)   /* A keyword candidate starts here. */
+#define DFA_WORD_END (1<<1)     /* A keyword candidate ended before the
+                                   bytes highlighted by this transition. */
+
+struct dfaTrans {
+    uint16_t next;          /* Next state. */
+    unsigned char hl;       /* Highlight of the byte. */
+    unsigned char back;     /* Previous bytes to highlight like this one. */
+    unsigned char flags;    /* DFA_* flags. */
+};
+
+struct syntaxDFA {
+    unsigned char cls[256];     /* Class of every byte. */
+    int numclasses;
+    int numstates;
+    struct dfaTrans *trans;     /* numstates*numclasses transitions. */
+    unsigned char *inword;      /* State is inside a keyword candidate. */
+    unsigned char *incomment;   /* State is inside a multi line comment. */
+    int start;                  /* Start state of a row. */
+    int mlstart;                /* Same, for rows starting in a comment. */
+};
+
+/* The language features a definition describes. */
+struct syntaxSpec {
+    char scs[DFA_MAX_DELIM+1];  /* Single line comment start. */
+    char mcs[DFA_MAX_DELIM+1];  /* Multi line comment start. */
+    char mce[DFA_MAX_DELIM+1];  /* Multi line comment end. */
+    char quotes[16];            /* String delimiters. */
+    int escape;                 /* Escape char inside strings. */
+    int numbers;                /* Highlight numbers? */
+    unsigned char sep[256];     /* Separators. */
+};
+
+/* Lexer contexts and token states, see lexStep(). */
+#define LEX_CODE 0
+#define LEX_STRING 1
+#define LEX_ESCAPE 2
+#define LEX_MLCOMMENT 3
+#define LEX_COMMENT 4
+
+#define TOK_SEP 0       /* After a separator: words and numbers can start. */
+#define TOK_WORD 1      /* Inside a word that started after a separator. */
+#define TOK_OTHER 2     /* Inside something else. */
+#define TOK_NUMBER 3
+
+/* The state of the lexer: only chars, so that states can be compared with
+ * memcmp() while building the DFA. */
+struct lexState {
+    unsigned char ctx;      /* LEX_* context. */
+    unsigned char quote;    /* Quote that started the current string. */
+    unsigned char tok;      /* TOK_* state, in the LEX_CODE context. */
+    unsigned char plen;     /* Length of 'pend'. */
+    unsigned char pok;      /* Bit N set if pend[N] is after a separator. */
+    char pend[DFA_MAX_DELIM];   /* Last bytes, that may start a delimiter. */
+};
+
+/* Remember the longest suffix of 'buf' that may become one of the
+ * delimiters 'a' or 'b' (a single line comment start when 'ok_a' is given:
+ * it must start after a separator) as the pending bytes of 'st'. */
+void lexSetPending(struct lexState *st, char *buf, int len, unsigned int ok,
+                   char *a, int need_ok_a, char *b)
+{
+    int alen = strlen(a), blen = b ? (int)strlen(b) : 0;
+
+    for (int k = 0; k < len; k++) {
+        int n = len-k;
+        if ((n < alen && !memcmp(buf+k,a,n) && (!need_ok_a || (ok>>k & 1))) ||
+            (n < blen && !memcmp(buf+k,b,n)))
+        {
+            memcpy(st->pend,buf+k,n);
+            st->plen = n;
+            st->pok = ok>>k;
+            return;
+        }
+    }
+    st->plen = 0;
+    st->pok = 0;
+}
+
+/* The lexer rules: feed the byte 'c' to the lexer in the state 'st',
+ * filling the transition 't' with how to highlight it (the next state is
+ * left in 'st'). This is run only when the DFA is built. */
+void lexStep(struct syntaxSpec *sp, struct lexState *st, int c,
+             struct dfaTrans *t)
+{
+    char buf[DFA_MAX_DELIM+1];
+    int len = st->plen+1;
+
+    memcpy(buf,st->pend,st->plen);
+    buf[st->plen] = c;
+    t->back = 0;
+    t->flags = 0;
+
+    switch(st->ctx) {
+    case LEX_COMMENT:
+        t->hl = HL_COMMENT;
+        return;
+    case LEX_ESCAPE:
+        t->hl = HL_STRING;
+        st->ctx = LEX_STRING;
+        return;
+    case LEX_STRING:
+        t->hl = HL_STRING;
+        if (c == sp->escape) {
+            st->ctx = LEX_ESCAPE;
+        } else if (c == st->quote) {
+            st->ctx = LEX_CODE;
+            st->quote = 0;
+            st->tok = TOK_OTHER;
+        }
+        return;
+    case LEX_MLCOMMENT: {
+        int n = strlen(sp->mce);
+        t->hl = HL_MLCOMMENT;
+        if (len >= n && !memcmp(buf+len-n,sp->mce,n)) {
+            st->ctx = LEX_CODE;
+            st->tok = TOK_SEP;
+            st->plen = st->pok = 0;
+        } else {
+            lexSetPending(st,buf,len,0,sp->mce,0,NULL);
+        }
+        return;
+    }
+    }
+
+    /* LEX_CODE. The longest delimiter ending with this byte wins. */
+    unsigned int ok = st->pok | ((st->tok == TOK_SEP) << st->plen);
+    for (int k = 0; k < len; k++) {
+        int n = len-k, ctx;
+        if (sp->scs[0] && n == (int)strlen(sp->scs) &&
+            !memcmp(buf+k,sp->scs,n) && (ok>>k & 1))
+        {
+            ctx = LEX_COMMENT;
+            t->hl = HL_COMMENT;
+        } else if (sp->mcs[0] && n == (int)strlen(sp->mcs) &&
+                   !memcmp(buf+k,sp->mcs,n))
+        {
+            ctx = LEX_MLCOMMENT;
+            t->hl = HL_MLCOMMENT;
+        } else if (n == 1 && c && strchr(sp->quotes,c)) {
+            ctx = LEX_STRING;
+            t->hl = HL_STRING;
+            st->quote = c;
+        } else {
+            continue;
+        }
+        t->back = n-1;
+        if (st->tok == TOK_WORD) t->flags |= DFA_WORD_END;
+        st->ctx = ctx;
+        st->tok = TOK_SEP;
+        st->plen = st->pok = 0;
+        return;
+    }
+
+    /* Not a delimiter (yet): a byte of normal text. */
+    int tok;
+    if (!(HLCLASS(c) & HLC_PRINT)) {
+        t->hl = HL_NONPRINT;
+        tok = TOK_OTHER;
+    } else if (sp->numbers &&
+               ((isdigit(c) && (st->tok == TOK_SEP || st->tok == TOK_NUMBER)) ||
+                (c == '.' && st->tok == TOK_NUMBER)))
+    {
+        t->hl = HL_NUMBER;
+        tok = TOK_NUMBER;
+    } else if (sp->sep[c]) {
+        t->hl = HL_NORMAL;
+        tok = TOK_SEP;
+    } else {
+        t->hl = HL_NORMAL;
+        if (st->tok == TOK_SEP) t->flags |= DFA_WORD_START;
+        tok = (st->tok == TOK_SEP || st->tok == TOK_WORD) ? TOK_WORD :
+                                                            TOK_OTHER;
+    }
+    if (st->tok == TOK_WORD && tok != TOK_WORD) t->flags |= DFA_WORD_END;
+    st->tok = tok;
+    lexSetPending(st,buf,len,ok,sp->scs,1,sp->mcs);
 }
 
-/* Return true if the specified row last char is part of a multi line comment
- * that starts at this row or at one before, and does not end at the end
- * of the row but spawns to the next row. */
-int editorRowHasOpenComment(erow *row) {
-    if (row->hl && row->rsize && row->hl[row->rsize-1] == HL_MLCOMMENT &&
-        (row->rsize < 2 || (row->render[row->rsize-2] != '*' ||
-                            row->render[row->rsize-1] != '/'))) return 1;
+/* Return the DFA state for the lexer state 'st', adding it if it's new. */
+int dfaStateId(struct lexState **states, int *numstates, struct lexState *st) {
+    for (int j = 0; j < *numstates; j++)
+        if (!memcmp((*states)+j,st,sizeof(*st))) return j;
+    *states = realloc(*states,sizeof(**states)*(*numstates+1));
+    (*states)[*numstates] = *st;
+    return (*numstates)++;
+}
+
+/* Build the DFA for the language described by 'sp'. Returns NULL if it
+ * has too many states. */
+struct syntaxDFA *dfaBuild(struct syntaxSpec *sp) {
+    struct syntaxDFA *d = calloc(1,sizeof(*d));
+    int sig2cls[512], rep[256], j, c;
+
+    /* Bytes that the lexer treats the same way share a class. Delimiter
+     * bytes get a class of their own. */
+    for (j = 0; j < 512; j++) sig2cls[j] = -1;
+    for (c = 0; c < 256; c++) {
+        int sig;
+        if (c && (strchr(sp->scs,c) || strchr(sp->mcs,c) ||
+                  strchr(sp->mce,c) || strchr(sp->quotes,c) ||
+                  c == sp->escape))
+        {
+            sig = 256+c;
+        } else {
+            sig = ((HLCLASS(c) & HLC_PRINT) != 0) | (isdigit(c) != 0) << 1 |
+                  (c == '.') << 2 | (sp->sep[c] != 0) << 3;
+        }
+        if (sig2cls[sig] == -1) {
+            rep[d->numclasses] = c;
+            sig2cls[sig] = d->numclasses++;
+        }
+        d->cls[c] = sig2cls[sig];
+    }
+
+    /* Explore the states reachable from the row start states. */
+    struct lexState *states = NULL, st;
+    int numstates = 0;
+    memset(&st,0,sizeof(st));
+    d->start = dfaStateId(&states,&numstates,&st);
+    st.ctx = LEX_MLCOMMENT;
+    d->mlstart = sp->mcs[0] ? dfaStateId(&states,&numstates,&st) : d->start;
+    for (j = 0; j < numstates; j++) {
+        if (numstates > DFA_MAX_STATES) {
+            free(states);
+            free(d->trans);
+            free(d);
+            return NULL;
+        }
+        d->trans = realloc(d->trans,
+                           sizeof(struct dfaTrans)*numstates*d->numclasses);
+        for (int k = 0; k < d->numclasses; k++) {
+            struct dfaTrans *t = d->trans+j*d->numclasses+k;
+            st = states[j];
+            lexStep(sp,&st,rep[k],t);
+            t->next = dfaStateId(&states,&numstates,&st);
+        }
+    }
+    d->numstates = numstates;
+    d->trans = realloc(d->trans,
+                       sizeof(struct dfaTrans)*numstates*d->numclasses);
+    d->inword = malloc(numstates);
+    d->incomment = malloc(numstates);
+    for (j = 0; j < numstates; j++) {
+        d->inword[j] = states[j].ctx == LEX_CODE && states[j].tok == TOK_WORD;
+        d->incomment[j] = states[j].ctx == LEX_MLCOMMENT;
+    }
+    free(states);
+    return d;
+}
+
+/* Highlight the keyword candidate 'p' of length 'len', if it's a keyword. */
+#define DFA_KEYWORD(s,p,len,hl) do { \
+    if ((len) > 0) { \
+        int kw = editorSyntaxKeyword(s,p,len); \
+        if (kw != HL_NORMAL) memset(hl,kw,len); \
+    } \
+} while(0)
+
+/* Like editorHighlightRender(), for the syntaxes compiled into a DFA. */
+int editorHighlightDFA(struct editorSyntax *s, char *render, int rsize,
+                       unsigned char *hl, int in_comment)
+{
+    struct syntaxDFA *d = s->dfa;
+    int state = in_comment ? d->mlstart : d->start, wstart = 0;
+
+    for (int i = 0; i < rsize; i++) {
+        struct dfaTrans *t = d->trans+state*d->numclasses+
+                             d->cls[(unsigned char)render[i]];
+        if (t->flags & DFA_WORD_END)
+            DFA_KEYWORD(s,render+wstart,i-t->back-wstart,hl+wstart);
+        if (t->flags & DFA_WORD_START) wstart = i;
+        hl[i] = t->hl;
+        if (t->back) memset(hl+i-t->back,t->hl,t->back);
+        state = t->next;
+    }
+    if (d->inword[state])
+        DFA_KEYWORD(s,render+wstart,rsize-wstart,hl+wstart);
+    return d->incomment[state];
+}
+
+/* Syntaxes defined at run time. They are looked up before HLDB. */
+struct editorSyntax **HLDBUser = NULL;
+unsigned int HLDBUserLen = 0;
+
+/* Decode the \xHH, \s and \\ escapes of the word 'w' in place. */
+void syntaxUnescape(char *w) {
+    char *d = w;
+    while(*w) {
+        if (w[0] == '\\' && w[1] == 's') {
+            *d++ = ' ';
+            w += 2;
+        } else if (w[0] == '\\' && w[1] == '\\') {
+            *d++ = '\\';
+            w += 2;
+        } else if (w[0] == '\\' && w[1] == 'x' && isxdigit(w[2]) &&
+                   isxdigit(w[3]))
+        {
+            char hex[3] = {w[2],w[3],0};
+            *d++ = strtol(hex,NULL,16);
+            w += 4;
+        } else {
+            *d++ = *w++;
+        }
+    }
+    *d = '\0';
+}
+
+/* Append the word 'w' to the NULL terminated array '*list', adding the
+ * 'suffix' string to it. */
+void syntaxListAppend(char ***list, int *len, char *w, char *suffix) {
+    *list = realloc(*list,sizeof(char*)*(*len+2));
+    (*list)[*len] = malloc(strlen(w)+strlen(suffix)+1);
+    strcpy((*list)[*len],w);
+    strcat((*list)[*len],suffix);
+    (*list)[++*len] = NULL;
+}
+
+/* Copy the delimiter 'w' into 'dst', that has room for DFA_MAX_DELIM
+ * bytes. Returns 0 on success, -1 if it's empty or too long. */
+int syntaxSetDelim(char *dst, char *w) {
+    if (w == NULL || strlen(w) == 0 || strlen(w) > DFA_MAX_DELIM) return -1;
+    strcpy(dst,w);
     return 0;
 }
 
-/* Set every byte of row->hl (that corresponds to every character in the line)
- * to the right syntax highlight type (HL_* defines). */
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl,row->rsize);
-    memset(row->hl,HL_NORMAL,row->rsize);
+/* Parse and compile the syntax definition 'text' of length 'len', and add
+ * it to the known syntaxes, replacing a previous one with the same name.
+ * Returns the new syntax, or NULL on error, after logging the problem to
+ * stderr mentioning 'origin'. */
+struct editorSyntax *editorDefineSyntax(const char *text, size_t len,
+                                        const char *origin)
+{
+    struct syntaxSpec sp;
+    char *name = NULL, **filematch = NULL, **keywords = NULL;
+    int nfm = 0, nkw = 0, lineno = 0, j;
+    char *copy = malloc(len+1), *line, *next, *err = NULL;
+
+    memcpy(copy,text,len);
+    copy[len] = '\0';
+    memset(&sp,0,sizeof(sp));
+    sp.escape = '\\';
+    for (j = 0; j < 256; j++) sp.sep[j] = isspace(j) || j == '\0';
+    for (char *s = ",.()+-/*=~%[];"; *s; s++) sp.sep[(unsigned char)*s] = 1;
+
+    for (line = copy; line && !err; line = next) {
+        next = strchr(line,'\n');
+        if (next) *next++ = '\0';
+        lineno++;
+        if (line[0] == '#') continue;
+
+        char *argv[64], *tok, *save;
+        int argc = 0;
+        for (tok = strtok_r(line," \t\r",&save); tok && argc < 64;
+             tok = strtok_r(NULL," \t\r",&save))
+        {
+            syntaxUnescape(tok);
+            argv[argc++] = tok;
+        }
+        if (argc == 0) continue;
+
+        if (!strcmp(argv[0],"syntax") && argc == 2) {
+            free(name);
+            name = strdup(argv[1]);
+        } else if (!strcmp(argv[0],"filematch")) {
+            for (j = 1; j < argc; j++)
+                syntaxListAppend(&filematch,&nfm,argv[j],"");
+        } else if (!strcmp(argv[0],"keywords")) {
+            for (j = 1; j < argc; j++)
+                syntaxListAppend(&keywords,&nkw,argv[j],"");
+        } else if (!strcmp(argv[0],"types")) {
+            for (j = 1; j < argc; j++)
+                syntaxListAppend(&keywords,&nkw,argv[j],"|");
+        } else if (!strcmp(argv[0],"comment") && argc == 2) {
+            if (syntaxSetDelim(sp.scs,argv[1])) err = "bad comment delimiter";
+        } else if (!strcmp(argv[0],"mlcomment") && argc == 3) {
+            if (syntaxSetDelim(sp.mcs,argv[1]) ||
+                syntaxSetDelim(sp.mce,argv[2]))
+                err = "bad multi line comment delimiters";
+        } else if (!strcmp(argv[0],"strings") && argc == 2) {
+            if (strlen(argv[1]) >= sizeof(sp.quotes)) err = "too many quotes";
+            else strcpy(sp.quotes,argv[1]);
+        } else if (!strcmp(argv[0],"escape") && argc == 2) {
+            sp.escape = !strcmp(argv[1],"none") ? -1 :
+                                                  (unsigned char)argv[1][0];
+        } else if (!strcmp(argv[0],"numbers") && argc == 1) {
+            sp.numbers = 1;
+        } else if (!strcmp(argv[0],"separators") && argc == 2) {
+            for (j = 0; j < 256; j++) sp.sep[j] = isspace(j) || j == '\0';
+            for (char *s = argv[1]; *s; s++) sp.sep[(unsigned char)*s] = 1;
+        } else {
+            err = "unknown or malformed directive";
+        }
+    }
+    free(copy);
+    if (!err && name == NULL) err = "missing 'syntax <name>' line";
+    if (!err && filematch == NULL) err = "missing 'filematch' line";
+
+    struct syntaxDFA *dfa = err ? NULL : dfaBuild(&sp);
+    if (!err && dfa == NULL) err = "too complex";
+    if (err) {
+        fprintf(stderr,"Error: syntax definition %s, line %d: %s\n",
+            origin, lineno, err);
+        for (j = 0; j < nfm; j++) free(filematch[j]);
+        for (j = 0; j < nkw; j++) free(keywords[j]);
+        free(filematch);
+        free(keywords);
+        free(name);
+        return NULL;
+    }
+
+    struct editorSyntax *s = calloc(1,sizeof(*s));
+    s->name = name;
+    s->filematch = filematch;
+    s->keywords = keywords ? keywords : calloc(1,sizeof(char*));
+    s->dfa = dfa;
+    editorSyntaxCompile(s);
+
+    /* Syntaxes are never freed, since rows may be highlighted with them
+     * in other threads: a redefinition just takes the place of the old
+     * one in the list. */
+    for (j = 0; j < (int)HLDBUserLen; j++) {
+        if (!strcmp(HLDBUser[j]->name,name)) {
+            HLDBUser[j] = s;
+            return s;
+        }
+    }
+    HLDBUser = realloc(HLDBUser,sizeof(*HLDBUser)*(HLDBUserLen+1));
+    HLDBUser[HLDBUserLen++] = s;
+    return s;
+}
+
+/* Rows are highlighted one at a time, starting from the open comment state
+ * the previous row had at its end (the lexer state). When the state at the
+ * end of a row changes, the following rows would need to be highlighted
+ * again, possibly up to the end of the file: instead they are just marked
+ * as stale, and editorSyntaxCatchUp() fixes them when they are about to be
+ * shown or searched. */
 
-    if (E.syntax == NULL) return; /* No syntax, everything is HL_NORMAL. */
+/* Mark the rows from 'at' to the end of the file as possibly stale. */
+void editorSyntaxInvalidate(int at) {
+    if (E.hl_stale == -1 || at < E.hl_stale) E.hl_stale = at;
+}
+
+void editorUpdateSyntax(erow *row);
+
+/* Make sure the highlight of the rows up to 'upto' (included) is in sync
+ * with the state the previous rows end with. Only the rows whose start
+ * state actually changed are highlighted again, so this is cheap when
+ * nothing changed, and rows after 'upto' are left stale. */
+void editorSyntaxCatchUp(int upto) {
+    int j, from = E.hl_stale;
+
+    if (E.hl_stale == -1) return;
+    if (upto >= E.numrows) upto = E.numrows-1;
+    /* While the background threads are at work the rows before are likely
+     * still waiting for them: only the screen ending at 'upto' is checked,
+     * the rest is fixed when they are done, see editorHighlightFinish(). */
+    if (E.hljob && from < upto-E.screenrows) from = upto-E.screenrows;
+    for (j = from; j <= upto; j++) {
+        erow *row = E.row+j;
+        int in_comment = j > 0 && E.row[j-1].hl_oc;
+        if (row->hl_in != in_comment) editorUpdateSyntax(row);
+    }
+    if (E.hljob) return;
+    if (j > E.hl_stale) E.hl_stale = j < E.numrows ? j : -1;
+}
 
-    int i, prev_sep, in_string, in_comment;
+/* Set every byte of 'hl' (that corresponds to every character of the
+ * rendered row 'render') to the right syntax highlight type (HL_* defines)
+ * for the syntax 's'. 'in_comment' tells if the row starts inside a multi
+ * line comment: the same state at the end of the row is returned. This does
+ * not touch the editor state, so it's safe to call from other threads. */
+int editorHighlightRender(struct editorSyntax *s, char *render, int rsize,
+                          unsigned char *hl, int in_comment) {
+    int i, prev_sep, in_string, run;
     char *p;
-    char **keywords = E.syntax->keywords;
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+    char *scs = s->singleline_comment_start;
+    char *mcs = s->multiline_comment_start;
+    char *mce = s->multiline_comment_end;
+
+    if (s->dfa) return editorHighlightDFA(s,render,rsize,hl,in_comment);
+    memset(hl,HL_NORMAL,rsize);
+    /* Identifiers can be skipped only if they can't start a comment. */
+    int skip_words = !(HLCLASS(scs[0]) & HLC_WORD) &&
+                     !(HLCLASS(mcs[0]) & HLC_WORD);
 
     /* Point to the first non-space char. */
-    p = row->render;
+    p = render;
     i = 0; /* Current char offset */
-    while(*p && isspace(*p)) {
+    while(*p && (HLCLASS(*p) & HLC_SPACE)) {
         p++;
         i++;
     }
     prev_sep = 1; /* Tell the parser if 'i' points to start of word. */
     in_string = 0; /* Are we inside "" or '' ? */
-    in_comment = 0; /* Are we inside multi-line comment? */
-
-    /* If the previous line has an open comment, this line starts
-     * with an open comment state. */
-    if (row->idx > 0 && editorRowHasOpenComment(&E.row[row->idx-1]))
-        in_comment = 1;
 
     while(*p) {
         /* Handle // comments. */
         if (prev_sep && *p == scs[0] && *(p+1) == scs[1]) {
             /* From here to end is a comment */
-            memset(row->hl+i,HL_COMMENT,row->size-i);
-            return;
+            memset(hl+i,HL_COMMENT,rsize-i);
+            break;
         }
 
         /* Handle multi line comments. */
         if (in_comment) {
-            row->hl[i] = HL_MLCOMMENT;
+            hl[i] = HL_MLCOMMENT;
             if (*p == mce[0] && *(p+1) == mce[1]) {
-                row->hl[i+1] = HL_MLCOMMENT;
+                hl[i+1] = HL_MLCOMMENT;
                 p += 2; i += 2;
                 in_comment = 0;
                 prev_sep = 1;
@@ -915,11 +3306,15 @@ void editorUpdateSyntax(erow *row) {
             } else {
                 prev_sep = 0;
                 p++; i++;
+                /* Nothing but the comment end can change our state. */
+                run = hlFind3(p,rsize-i,mce[0],mce[0],mce[0]);
+                memset(hl+i,HL_MLCOMMENT,run);
+                p += run; i += run;
                 continue;
             }
         } else if (*p == mcs[0] && *(p+1) == mcs[1]) {
-            row->hl[i] = HL_MLCOMMENT;
-            row->hl[i+1] = HL_MLCOMMENT;
+            hl[i] = HL_MLCOMMENT;
+            hl[i+1] = HL_MLCOMMENT;
             p += 2; i += 2;
             in_comment = 1;
             prev_sep = 0;
@@ -928,20 +3323,28 @@ void editorUpdateSyntax(erow *row) {
 
         /* Handle "" and '' */
         if (in_string) {
-            row->hl[i] = HL_STRING;
-            if (*p == '\\') {
-                row->hl[i+1] = HL_STRING;
+            hl[i] = HL_STRING;
+            if (*p == '\\' && *(p+1)) {
+                hl[i+1] = HL_STRING;
                 p += 2; i += 2;
                 prev_sep = 0;
                 continue;
             }
-            if (*p == in_string) in_string = 0;
+            if (*p == in_string) {
+                in_string = 0;
+                p++; i++;
+                continue;
+            }
             p++; i++;
+            /* Skip to the closing quote, an escape or a comment start. */
+            run = hlFind3(p,rsize-i,in_string,'\\',mcs[0]);
+            memset(hl+i,HL_STRING,run);
+            p += run; i += run;
             continue;
         } else {
             if (*p == '"' || *p == '\'') {
                 in_string = *p;
-                row->hl[i] = HL_STRING;
+                hl[i] = HL_STRING;
                 p++; i++;
                 prev_sep = 0;
                 continue;
@@ -949,58 +3352,84 @@ void editorUpdateSyntax(erow *row) {
         }
 
         /* Handle non printable chars. */
-        if (!isprint(*p)) {
-            row->hl[i] = HL_NONPRINT;
+        if (!(HLCLASS(*p) & HLC_PRINT)) {
+            hl[i] = HL_NONPRINT;
             p++; i++;
             prev_sep = 0;
             continue;
         }
 
         /* Handle numbers */
-        if ((isdigit(*p) && (prev_sep || row->hl[i-1] == HL_NUMBER)) ||
-            (*p == '.' && i >0 && row->hl[i-1] == HL_NUMBER)) {
-            row->hl[i] = HL_NUMBER;
+        if (((HLCLASS(*p) & HLC_DIGIT) &&
+             (prev_sep || hl[i-1] == HL_NUMBER)) ||
+            (*p == '.' && i >0 && hl[i-1] == HL_NUMBER)) {
+            hl[i] = HL_NUMBER;
             p++; i++;
             prev_sep = 0;
             continue;
         }
 
-        /* Handle keywords and lib calls */
+        /* Handle keywords and lib calls: a keyword is a whole word, that
+         * is, it is followed by a separator. */
         if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen-1] == '|';
-                if (kw2) klen--;
-
-                if (!memcmp(p,keywords[j],klen) &&
-                    is_separator(*(p+klen)))
-                {
-                    /* Keyword */
-                    memset(row->hl+i,kw2 ? HL_KEYWORD2 : HL_KEYWORD1,klen);
-                    p += klen;
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
+            int klen = 0;
+            while(!(HLCLASS(p[klen]) & HLC_SEP)) klen++;
+            int kw = editorSyntaxKeyword(s,p,klen);
+            if (kw != HL_NORMAL) {
+                memset(hl+i,kw,klen);
+                p += klen;
+                i += klen;
                 prev_sep = 0;
                 continue; /* We had a keyword match */
             }
         }
 
-        /* Not special chars */
-        prev_sep = is_separator(*p);
-        p++; i++;
+        /* Not special chars. The rest of an identifier, or of a run of
+         * spaces, is normal text as well and leaves us in the same state. */
+        if (skip_words && (HLCLASS(*p) & HLC_WORD)) {
+            run = hlSpanWord(p,rsize-i);
+            prev_sep = 0;
+        } else if (*p == ' ') {
+            run = hlSpanByte(p,rsize-i,' ');
+            prev_sep = 1;
+        } else {
+            run = 1;
+            prev_sep = is_separator(*p);
+        }
+        p += run; i += run;
+    }
+
+    return in_comment;
+}
+
+
+/* Set every byte of row->hl (that corresponds to every character in the line)
+ * to the right syntax highlight type (HL_* defines). */
+void editorUpdateSyntax(erow *row) {
+    row->hl = realloc(row->hl,row->rsize);
+    memset(row->hl,HL_NORMAL,row->rsize);
+    row->hl_in = row->hl_oc = 0;
+
+    if (E.syntax == NULL) return; /* No syntax, everything is HL_NORMAL. */
+    if (E.hl_deferred) {
+        /* The background threads will take care of it: -1 never matches
+         * the state of the previous row, so the row is also highlighted
+         * by editorSyntaxCatchUp() if it's needed before. */
+        row->hl_in = -1;
+        return;
     }
 
-    /* Propagate syntax change to the next row if the open commen
-     * state changed. This may recursively affect all the following rows
-     * in the file. */
-    int oc = editorRowHasOpenComment(row);
-    if (row->hl_oc != oc && row->idx+1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx+1]);
-    row->hl_oc = oc;
+    /* If the previous line has an open comment, this line starts
+     * with an open comment state. */
+    int in_comment = row->idx > 0 && E.row[row->idx-1].hl_oc;
+    row->hl_in = in_comment;
+    in_comment = editorHighlightRender(E.syntax,row->render,row->rsize,
+                                       row->hl,in_comment);
+
+    /* If the open comment state at the end of the row changed, the
+     * following rows are stale. They'll be fixed lazily. */
+    if (row->hl_oc != in_comment) editorSyntaxInvalidate(row->idx+1);
+    row->hl_oc = in_comment;
 }
 
 /* Maps syntax highlight token types to terminal colors. */
@@ -1017,63 +3446,120 @@ int editorSyntaxToColor(int hl) {
     }
 }
 
+/* Return 1 if the file name matches one of the patterns of the syntax 's',
+ * otherwise 0. */
+int editorSyntaxMatches(struct editorSyntax *s, char *filename) {
+    unsigned int i = 0;
+    while(s->filematch[i]) {
+        char *p;
+        int patlen = strlen(s->filematch[i]);
+        if ((p = strstr(filename,s->filematch[i])) != NULL) {
+            if (s->filematch[i][0] != '.' || p[patlen] == '\0')
+                return 1;
+        }
+        i++;
+    }
+    return 0;
+}
+
 /* Select the syntax highlight scheme depending on the filename,
- * setting it in the global state E.syntax. */
+ * setting it in the global state E.syntax. The syntaxes defined at run
+ * time win over the built-in ones. */
 void editorSelectSyntaxHighlight(char *filename) {
+    for (unsigned int j = 0; j < HLDBUserLen; j++) {
+        if (editorSyntaxMatches(HLDBUser[j],filename)) {
+            E.syntax = HLDBUser[j];
+            return;
+        }
+    }
     for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
         struct editorSyntax *s = HLDB+j;
-        unsigned int i = 0;
-        while(s->filematch[i]) {
-            char *p;
-            int patlen = strlen(s->filematch[i]);
-            if ((p = strstr(filename,s->filematch[i])) != NULL) {
-                if (s->filematch[i][0] != '.' || p[patlen] == '\0') {
-                    E.syntax = s;
-                    return;
-                }
-            }
-            i++;
+        if (editorSyntaxMatches(s,filename)) {
+            editorSyntaxCompile(s);
+            E.syntax = s;
+            return;
         }
     }
 }
 
+/* Switch to the syntax 's' for the current file. The rows are highlighted
+ * again lazily, as they are shown. */
+void editorSetSyntax(struct editorSyntax *s) {
+    E.syntax = s;
+    for (int j = 0; j < E.numrows; j++) E.row[j].hl_in = -1;
+    if (E.numrows) E.hl_stale = 0;
+}
+
 /* ======================= Editor rows implementation ======================= */
 
-/* Update the rendered version and the syntax highlight of a row. */
-void editorUpdateRow(erow *row) {
+/* Create a version of the 'size' bytes at 'chars' we can directly print on
+ * the screen, respecting tabs. The returned string is heap allocated and
+ * null terminated, its length is stored in '*rsize'. */
+char *editorRenderChars(const char *chars, int size, int *rsize) {
     unsigned int tabs = 0, nonprint = 0;
     int j, idx;
+    char *render;
 
-   /* Create a version of the row we can directly print on the screen,
-     * respecting tabs, substituting non printable characters with '?'. */
-    free(row->render);
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == TAB) tabs++;
+    for (j = 0; j < size; j++)
+        if (chars[j] == TAB) tabs++;
 
     unsigned long long allocsize =
-        (unsigned long long) row->size + tabs*8 + nonprint*9 + 1;
+        (unsigned long long) size + tabs*8 + nonprint*9 + 1;
     if (allocsize > UINT32_MAX) {
         printf("Some line of the edited file is too long for kilo\n");
         exit(1);
     }
 
-    row->render = malloc(row->size + tabs*8 + nonprint*9 + 1);
+    render = malloc(size + tabs*8 + nonprint*9 + 1);
     idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == TAB) {
-            row->render[idx++] = ' ';
-            while((idx+1) % 8 != 0) row->render[idx++] = ' ';
+    for (j = 0; j < size; j++) {
+        if (chars[j] == TAB) {
+            render[idx++] = ' ';
+            while((idx+1) % 8 != 0) render[idx++] = ' ';
         } else {
-            row->render[idx++] = row->chars[j];
+            render[idx++] = chars[j];
         }
     }
-    row->rsize = idx;
-    row->render[idx] = '\0';
+    render[idx] = '\0';
+    *rsize = idx;
+    return render;
+}
+
+void editorTrigramUpdateRow(erow *row);
+
+/* Update the rendered version and the syntax highlight of a row. */
+void editorUpdateRow(erow *row) {
+    E.version++;
+    editorTrigramUpdateRow(row);
+    free(row->render);
+    row->render = editorRenderChars(row->chars,row->size,&row->rsize);
 
     /* Update the syntax highlighting attributes of the row. */
     editorUpdateSyntax(row);
 }
 
+/* Convert the offset 'cx' of the row content into the offset of the same
+ * char in the rendered row. */
+int editorRowCxToRx(erow *row, int cx) {
+    int rx = 0;
+    for (int j = 0; j < cx && j < row->size; j++) {
+        rx++;
+        if (row->chars[j] == TAB)
+            while((rx+1) % 8 != 0) rx++;
+    }
+    return rx;
+}
+
+/* Must be called right before the content of 'row' is modified or freed:
+ * plugins may still reference it, see editorRowView(). */
+void editorRowChanging(erow *row) {
+#ifdef PLUGINS_ENABLED
+    if (row->numviews) editorReleaseRowViews(row);
+#else
+    (void)row;
+#endif
+}
+
 /* Insert a row at the specified position, shifting the other rows on the bottom
  * if required. */
 void editorInsertRow(int at, char *s, size_t len) {
@@ -1087,20 +3573,34 @@ void editorInsertRow(int at, char *s, size_t len) {
     E.row[at].chars = malloc(len+1);
     memcpy(E.row[at].chars,s,len+1);
     E.row[at].hl = NULL;
+    E.row[at].hl_in = 0;
     E.row[at].hl_oc = 0;
+#ifdef PLUGINS_ENABLED
+    E.row[at].views = NULL;
+    E.row[at].numviews = E.row[at].viewscap = 0;
+#endif
     E.row[at].render = NULL;
     E.row[at].rsize = 0;
     E.row[at].idx = at;
     editorUpdateRow(E.row+at);
     E.numrows++;
+    E.rows_gen++;
     E.dirty++;
+    /* The row after the new one used to follow a different row. */
+    if (at+1 < E.numrows) editorSyntaxInvalidate(at+1);
 }
 
 /* Free row's heap allocated stuff. */
 void editorFreeRow(erow *row) {
+    editorRowChanging(row);
     free(row->render);
     free(row->chars);
     free(row->hl);
+#ifdef PLUGINS_ENABLED
+    free(row->views);
+    row->views = NULL;
+    row->viewscap = 0;
+#endif
 }
 
 /* Remove the row at the specified position, shifting the remainign on the
@@ -1112,9 +3612,12 @@ void editorDelRow(int at) {
     row = E.row+at;
     editorFreeRow(row);
     memmove(E.row+at,E.row+at+1,sizeof(E.row[0])*(E.numrows-at-1));
-    for (int j = at; j < E.numrows-1; j++) E.row[j].idx++;
+    for (int j = at; j < E.numrows-1; j++) E.row[j].idx = j;
     E.numrows--;
+    E.rows_gen++;
+    E.version++;
     E.dirty++;
+    if (at < E.numrows) editorSyntaxInvalidate(at);
 }
 
 /* Turn the editor rows into a single heap-allocated string.
@@ -1146,6 +3649,7 @@ char *editorRowsToString(int *buflen) {
 /* Insert a character at the specified position in a row, moving the remaining
  * chars on the right if needed. */
 void editorRowInsertChar(erow *row, int at, int c) {
+    editorRowChanging(row);
     if (at > row->size) {
         /* Pad the string with spaces if the insert location is outside the
          * current length by more than a single character. */
@@ -1169,6 +3673,7 @@ void editorRowInsertChar(erow *row, int at, int c) {
 
 /* Append the string 's' at the end of a row */
 void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowChanging(row);
     row->chars = realloc(row->chars,row->size+len+1);
     memcpy(row->chars+row->size,s,len);
     row->size += len;
@@ -1180,6 +3685,7 @@ void editorRowAppendString(erow *row, char *s, size_t len) {
 /* Delete the character at offset 'at' from the specified row. */
 void editorRowDelChar(erow *row, int at) {
     if (row->size <= at) return;
+    editorRowChanging(row);
     memmove(row->chars+at,row->chars+at+1,row->size-at);
     editorUpdateRow(row);
     row->size--;
@@ -1230,6 +3736,7 @@ void editorInsertNewline(void) {
         /* We are in the middle of a line. Split it between two rows. */
         editorInsertRow(filerow+1,row->chars+filecol,row->size-filecol);
         row = &E.row[filerow];
+        editorRowChanging(row);
         row->chars[filecol] = '\0';
         row->size = filecol;
         editorUpdateRow(row);
@@ -1275,41 +3782,870 @@ void editorDelChar(void) {
         else
             E.cx--;
     }
-    if (row) editorUpdateRow(row);
-    E.dirty++;
+    if (row) editorUpdateRow(row);
+    E.dirty++;
+}
+
+/* ================================== Undo ================================== */
+
+/* Operations changing many rows at once (like replacing all the matches of
+ * a query) save the previous content of those rows in an undo record, so
+ * that CTRL-Z can bring it back in one step. Single keystrokes are not
+ * recorded. A record can only be undone while the rows are just like the
+ * operation left them: after other edits it would restore stale content
+ * over them. */
+
+#define KILO_UNDO_LEN 16
+
+struct undoRow {
+    int row;        /* Row index. */
+    char *chars;    /* Previous content, null terminated. */
+    int size;
+};
+
+struct undoRecord {
+    struct undoRow *rows;
+    int len;
+    int at, added;  /* Splices only: 'added' rows replaced the saved ones
+                     * starting at 'at'. It's -1 for other records. */
+    int before;     /* E.version before the operation... */
+    int after;      /* ...and after it. */
+};
+
+static struct undoRecord UndoStack[KILO_UNDO_LEN];  /* Oldest first. */
+static int UndoLen;
+
+/* Start a new undo record. */
+struct undoRecord *editorUndoBegin(void) {
+    struct undoRecord *u = malloc(sizeof(*u));
+    u->rows = NULL;
+    u->len = 0;
+    u->added = -1;
+    u->before = E.version;
+    return u;
+}
+
+/* Save the previous content of the row 'row' in the record. The record
+ * takes ownership of 'chars'. */
+void editorUndoSaveRow(struct undoRecord *u, int row, char *chars, int size) {
+    u->rows = realloc(u->rows,sizeof(struct undoRow)*(u->len+1));
+    u->rows[u->len].row = row;
+    u->rows[u->len].chars = chars;
+    u->rows[u->len].size = size;
+    u->len++;
+}
+
+void editorUndoFree(struct undoRecord *u) {
+    for (int j = 0; j < u->len; j++) free(u->rows[j].chars);
+    free(u->rows);
+}
+
+/* The operation is complete: push the record on the undo stack, forgetting
+ * the oldest record if full. */
+void editorUndoEnd(struct undoRecord *u) {
+    if (u->len == 0 && u->added <= 0) {
+        free(u);
+        return;
+    }
+    u->after = E.version;
+    if (UndoLen == KILO_UNDO_LEN) {
+        editorUndoFree(UndoStack);
+        memmove(UndoStack,UndoStack+1,sizeof(*u)*(KILO_UNDO_LEN-1));
+        UndoLen--;
+    }
+    UndoStack[UndoLen++] = *u;
+    free(u);
+}
+
+/* Replace the 'del' rows starting at 'at' with the 'n' rows 'lines' (of
+ * lengths 'lens') in a single edit: the rows are shifted once, and the new
+ * ones are not highlighted right away but left stale, so that only the ones
+ * that get shown are highlighted. The content of the removed rows is saved
+ * in the undo record 'u', if not NULL. */
+void editorSpliceRows(int at, int del, char **lines, int *lens, int n,
+                      struct undoRecord *u) {
+    int j, deferred = E.hl_deferred;
+
+    if (at > E.numrows) return;
+    if (del > E.numrows-at) del = E.numrows-at;
+    if (u) {
+        u->at = at;
+        u->added = n;
+    }
+    for (j = 0; j < del; j++) {
+        erow *row = E.row+at+j;
+        if (u) {
+            /* The undo record takes the content of the row: its views
+             * must not outlive it. */
+            editorRowChanging(row);
+            editorUndoSaveRow(u,at+j,row->chars,row->size);
+            row->chars = NULL;
+        }
+        editorFreeRow(row);
+    }
+    if (n != del) {
+        if (n > del) E.row = realloc(E.row,sizeof(erow)*(E.numrows+n-del));
+        memmove(E.row+at+n,E.row+at+del,sizeof(erow)*(E.numrows-at-del));
+        E.numrows += n-del;
+        for (j = at+n; j < E.numrows; j++) E.row[j].idx = j;
+    }
+
+    E.hl_deferred = 1;
+    for (j = 0; j < n; j++) {
+        erow *row = E.row+at+j;
+        row->size = lens[j];
+        row->chars = malloc(lens[j]+1);
+        memcpy(row->chars,lines[j],lens[j]);
+        row->chars[lens[j]] = '\0';
+        row->hl = NULL;
+        row->hl_in = 0;
+        row->hl_oc = 0;
+#ifdef PLUGINS_ENABLED
+        row->views = NULL;
+        row->numviews = row->viewscap = 0;
+#endif
+        row->render = NULL;
+        row->rsize = 0;
+        row->idx = at+j;
+        editorUpdateRow(row);
+    }
+    E.hl_deferred = deferred;
+    /* The background highlighting results, if any, are for other rows. */
+    E.rows_gen++;
+    E.version++;
+    E.dirty++;
+    if (at < E.numrows) editorSyntaxInvalidate(at);
+}
+
+/* Make sure the cursor is not past the end of the row it is on. */
+void editorClampCursor(void) {
+    int filerow = E.rowoff+E.cy;
+    int filecol = E.coloff+E.cx;
+
+    /* Rows may have been deleted under it, too. */
+    if (filerow > E.numrows) {
+        E.cy -= filerow-E.numrows;
+        if (E.cy < 0) {
+            E.rowoff += E.cy;
+            E.cy = 0;
+        }
+        filerow = E.numrows;
+    }
+    erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+    int rowlen = row ? row->size : 0;
+
+    if (filecol > rowlen) {
+        E.cx -= filecol-rowlen;
+        if (E.cx < 0) {
+            E.coloff += E.cx;
+            E.cx = 0;
+        }
+    }
+}
+
+/* Replace 'del' rows with 'n' new ones, as by editorSpliceRows(), in a
+ * single undoable step. */
+void editorEditRows(int at, int del, char **lines, int *lens, int n) {
+    struct undoRecord *u = editorUndoBegin();
+    editorSpliceRows(at,del,lines,lens,n,u);
+    editorUndoEnd(u);
+    editorClampCursor();
+}
+
+/* Undo the last recorded operation. */
+void editorUndo(void) {
+    if (UndoLen == 0) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    struct undoRecord *u = UndoStack+UndoLen-1;
+    if (u->after != E.version) {
+        editorSetStatusMessage("Can't undo: the file changed since");
+        return;
+    }
+    if (u->added != -1) {
+        /* The saved rows take the place of the added ones. */
+        char **lines = malloc(sizeof(char*)*(u->len+1));
+        int *lens = malloc(sizeof(int)*(u->len+1));
+        for (int j = 0; j < u->len; j++) {
+            lines[j] = u->rows[j].chars;
+            lens[j] = u->rows[j].size;
+        }
+        editorSpliceRows(u->at,u->added,lines,lens,u->len,NULL);
+        free(lines);
+        free(lens);
+    } else {
+        for (int j = u->len-1; j >= 0; j--) {
+            erow *row = E.row+u->rows[j].row;
+            editorRowChanging(row);
+            free(row->chars);
+            row->chars = u->rows[j].chars;
+            row->size = u->rows[j].size;
+            u->rows[j].chars = NULL;
+            editorUpdateRow(row);
+        }
+    }
+    E.dirty++;
+    editorSetStatusMessage("Undone: %d rows restored", u->len);
+    editorUndoFree(u);
+    UndoLen--;
+    /* The rows are back to how the previous operation left them. */
+    if (UndoLen && UndoStack[UndoLen-1].after == u->before)
+        UndoStack[UndoLen-1].after = E.version;
+    editorClampCursor();
+}
+
+/* ============================== Trigram index ============================= */
+
+/* With KILO_TRIGRAMS set in the environment, an index maps every trigram
+ * (three consecutive bytes, lowercased) to the rows containing it, so that
+ * a find query of three chars or more only needs to look at the rows
+ * containing all of its trigrams. Rows are referenced by a stable id
+ * (erow.uid) instead of their index, that changes when rows are inserted
+ * or deleted above: a row that changes just gets a new id, and the
+ * postings of the old one are ignored, since no row has it anymore. Ids
+ * only grow, so the posting lists stay sorted by appending to them.
+ *
+ * The index of the whole file is built by a thread over a copy of the
+ * rows, and installed by the main thread, that then indexes the rows
+ * changed in the meantime. When most of the ids in the index are dead,
+ * the index is built again the same way. */
+
+#define KILO_TRI_MIN_QUERY 3    /* Shorter queries scan the rows. */
+#define KILO_TRI_DEAD_RATIO 2   /* Rebuild when ids are this times the rows. */
+#define TRI_EMPTY 0xffffffff
+
+struct triPosting {
+    uint32_t key;       /* The trigram, or TRI_EMPTY for a free slot. */
+    uint32_t len, cap;
+    uint32_t *uids;     /* Ids of the rows containing it, ascending. */
+};
+
+struct triIndex {
+    struct triPosting *table;   /* Open addressing hash table. */
+    uint32_t size;              /* Slots, a power of two. */
+    uint32_t used;              /* Trigrams in the table. */
+    size_t postings;            /* Ids in all the lists. */
+    uint32_t nuids;             /* Row versions indexed, dead ones too. */
+};
+
+struct triBuild {
+    pthread_t thread;
+    char *buf;              /* Copy of the rows content. */
+    size_t *off;            /* Offset of every row in 'buf'... */
+    int *len;               /* ...its length... */
+    uint32_t *uids;         /* ...and its id, in ascending id order. */
+    int numrows;
+    uint32_t next_uid;      /* Rows with greater ids changed later. */
+    struct triIndex *idx;   /* The result. */
+    uint64_t start;
+    int threaded;           /* Built by its own thread? */
+    pthread_mutex_t lock;
+    int done;               /* Protected by 'lock'. */
+};
+
+struct triIndex *triNew(void) {
+    struct triIndex *idx = calloc(1,sizeof(*idx));
+    idx->size = 4096;
+    idx->table = malloc(sizeof(struct triPosting)*idx->size);
+    for (uint32_t j = 0; j < idx->size; j++) {
+        idx->table[j].key = TRI_EMPTY;
+        idx->table[j].uids = NULL;
+    }
+    return idx;
+}
+
+void triFree(struct triIndex *idx) {
+    if (idx == NULL) return;
+    for (uint32_t j = 0; j < idx->size; j++) free(idx->table[j].uids);
+    free(idx->table);
+    free(idx);
+}
+
+/* Return the memory used by the index, in bytes. */
+size_t triMemory(struct triIndex *idx) {
+    size_t bytes = sizeof(*idx)+sizeof(struct triPosting)*idx->size;
+    for (uint32_t j = 0; j < idx->size; j++)
+        bytes += sizeof(uint32_t)*idx->table[j].cap;
+    return bytes;
+}
+
+static inline uint32_t triHash(uint32_t key) {
+    key ^= key >> 15;
+    key *= 0x2c1b3c6d;
+    key ^= key >> 12;
+    return key;
+}
+
+static inline uint32_t triKey(const char *p) {
+    return (uint32_t)tolower((unsigned char)p[0]) << 16 |
+           (uint32_t)tolower((unsigned char)p[1]) << 8 |
+           (uint32_t)tolower((unsigned char)p[2]);
+}
+
+/* Return the posting list of the trigram 'key'. If missing, it is created
+ * when 'create' is true, otherwise NULL is returned. */
+struct triPosting *triLookup(struct triIndex *idx, uint32_t key, int create) {
+    uint32_t mask = idx->size-1, slot = triHash(key) & mask;
+
+    while(idx->table[slot].key != TRI_EMPTY) {
+        if (idx->table[slot].key == key) return idx->table+slot;
+        slot = (slot+1) & mask;
+    }
+    if (!create) return NULL;
+
+    if ((idx->used+1)*2 > idx->size) {
+        /* Keep the table at most half full. */
+        struct triPosting *old = idx->table;
+        uint32_t oldsize = idx->size;
+        idx->size *= 2;
+        idx->table = malloc(sizeof(struct triPosting)*idx->size);
+        for (uint32_t j = 0; j < idx->size; j++) {
+            idx->table[j].key = TRI_EMPTY;
+            idx->table[j].uids = NULL;
+        }
+        mask = idx->size-1;
+        for (uint32_t j = 0; j < oldsize; j++) {
+            if (old[j].key == TRI_EMPTY) continue;
+            slot = triHash(old[j].key) & mask;
+            while(idx->table[slot].key != TRI_EMPTY) slot = (slot+1) & mask;
+            idx->table[slot] = old[j];
+        }
+        free(old);
+        slot = triHash(key) & mask;
+        while(idx->table[slot].key != TRI_EMPTY) slot = (slot+1) & mask;
+    }
+    struct triPosting *p = idx->table+slot;
+    p->key = key;
+    p->len = p->cap = 0;
+    p->uids = NULL;
+    idx->used++;
+    return p;
+}
+
+/* Index the row content 's' of length 'len' under the id 'uid', that must
+ * be greater than the ids already indexed. */
+void triAddRow(struct triIndex *idx, uint32_t uid, const char *s, int len) {
+    for (int j = 0; j+3 <= len; j++) {
+        struct triPosting *p = triLookup(idx,triKey(s+j),1);
+        /* The same trigram may appear many times in the row. */
+        if (p->len && p->uids[p->len-1] == uid) continue;
+        if (p->len == p->cap) {
+            p->cap = p->cap ? p->cap*2 : 4;
+            p->uids = realloc(p->uids,sizeof(uint32_t)*p->cap);
+        }
+        p->uids[p->len++] = uid;
+        idx->postings++;
+    }
+    idx->nuids++;
+}
+
+/* Intersect the sorted ids 'a' (modified in place) with the sorted 'b'.
+ * Returns the ids left in 'a'. */
+uint32_t triIntersect(uint32_t *a, uint32_t alen, uint32_t *b, uint32_t blen) {
+    uint32_t i = 0, j = 0, n = 0;
+
+    while(i < alen && j < blen) {
+        if (a[i] < b[j]) i++;
+        else if (a[i] > b[j]) j++;
+        else {
+            a[n++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+/* If the trigram index can help with the query 'query' of length 'qlen',
+ * set '*rows' to the ascending indexes of the rows that may contain it
+ * (ignoring case) and return their number. Otherwise -1 is returned, and
+ * every row must be searched. */
+int editorTrigramCandidates(const char *query, int qlen, int **rows) {
+    struct triIndex *idx = E.tri;
+    struct triPosting **lists;
+    int nlists = 0, j, n = 0;
+
+    if (idx == NULL || qlen < KILO_TRI_MIN_QUERY) return -1;
+
+    *rows = malloc(sizeof(int)*(E.numrows ? E.numrows : 1));
+    lists = malloc(sizeof(*lists)*(qlen-2));
+    for (j = 0; j+3 <= qlen; j++) {
+        struct triPosting *p = triLookup(idx,triKey(query+j),0);
+        if (p == NULL) {
+            /* A trigram no row ever had. */
+            free(lists);
+            return 0;
+        }
+        lists[nlists++] = p;
+    }
+
+    /* Start from the shortest list, so that the intersections only get
+     * cheaper. */
+    int shortest = 0;
+    for (j = 1; j < nlists; j++)
+        if (lists[j]->len < lists[shortest]->len) shortest = j;
+    uint32_t clen = lists[shortest]->len;
+    uint32_t *cand = malloc(sizeof(uint32_t)*(clen ? clen : 1));
+    memcpy(cand,lists[shortest]->uids,sizeof(uint32_t)*clen);
+    for (j = 0; j < nlists && clen; j++) {
+        if (lists[j] == lists[shortest]) continue;
+        clen = triIntersect(cand,clen,lists[j]->uids,lists[j]->len);
+    }
+    free(lists);
+
+    /* Back from ids to rows: the ids of deleted or changed rows are not
+     * found in any row. */
+    if (clen) {
+        unsigned char *bits = calloc(E.next_uid/8+1,1);
+        for (uint32_t k = 0; k < clen; k++)
+            bits[cand[k]>>3] |= 1<<(cand[k]&7);
+        for (j = 0; j < E.numrows; j++) {
+            uint32_t uid = E.row[j].uid;
+            if (bits[uid>>3] & (1<<(uid&7))) (*rows)[n++] = j;
+        }
+        free(bits);
+    }
+    free(cand);
+    return n;
+}
+
+/* Index the rows copied in 'arg', a struct triBuild. */
+void *editorTrigramBuild(void *arg) {
+    struct triBuild *b = arg;
+    struct triIndex *idx = triNew();
+
+    for (int j = 0; j < b->numrows; j++)
+        triAddRow(idx,b->uids[j],b->buf+b->off[j],b->len[j]);
+    pthread_mutex_lock(&b->lock);
+    b->idx = idx;
+    b->done = 1;
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+struct triSortRow {
+    uint32_t uid;
+    int row;
+};
+
+int triSortRowCmp(const void *a, const void *b) {
+    uint32_t ua = ((const struct triSortRow*)a)->uid;
+    uint32_t ub = ((const struct triSortRow*)b)->uid;
+    return ua < ub ? -1 : ua > ub;
+}
+
+/* Return the rows with id 'from' or greater, sorted by id, storing their
+ * number in '*count'. */
+struct triSortRow *triRowsSince(uint32_t from, int *count) {
+    struct triSortRow *r = malloc(sizeof(*r)*(E.numrows ? E.numrows : 1));
+    int n = 0;
+
+    for (int j = 0; j < E.numrows; j++) {
+        if (E.row[j].uid < from) continue;
+        r[n].uid = E.row[j].uid;
+        r[n].row = j;
+        n++;
+    }
+    qsort(r,n,sizeof(*r),triSortRowCmp);
+    *count = n;
+    return r;
+}
+
+/* Start building the trigram index of the buffer in background, if the
+ * index is enabled and no build is already in progress. */
+void editorTrigramStart(void) {
+    struct triBuild *b;
+    struct triSortRow *order;
+    size_t total = 0;
+    int j;
+
+    if (E.tribuild || !getenv("KILO_TRIGRAMS")) return;
+    b = calloc(1,sizeof(*b));
+    b->start = ustime();
+    b->next_uid = E.next_uid;
+    order = triRowsSince(0,&b->numrows);
+    for (j = 0; j < E.numrows; j++) total += E.row[j].size;
+    b->buf = malloc(total ? total : 1);
+    b->off = malloc(sizeof(size_t)*(E.numrows ? E.numrows : 1));
+    b->len = malloc(sizeof(int)*(E.numrows ? E.numrows : 1));
+    b->uids = malloc(sizeof(uint32_t)*(E.numrows ? E.numrows : 1));
+    total = 0;
+    for (j = 0; j < b->numrows; j++) {
+        erow *row = E.row+order[j].row;
+        memcpy(b->buf+total,row->chars,row->size);
+        b->off[j] = total;
+        b->len[j] = row->size;
+        b->uids[j] = order[j].uid;
+        total += row->size;
+    }
+    free(order);
+    pthread_mutex_init(&b->lock,NULL);
+    E.tribuild = b;
+    if (pthread_create(&b->thread,NULL,editorTrigramBuild,b) == 0)
+        b->threaded = 1;
+    else
+        editorTrigramBuild(b); /* Installed as usually. */
+}
+
+/* Install the trigram index once built in background, indexing the rows
+ * changed meanwhile. Must be called by the main thread. Returns 1 if the
+ * index was installed, so that the caller can refresh the status bar,
+ * otherwise 0. */
+int editorTrigramDrain(void) {
+    struct triBuild *b = E.tribuild;
+    int done, n;
+
+    if (b == NULL) return 0;
+    pthread_mutex_lock(&b->lock);
+    done = b->done;
+    pthread_mutex_unlock(&b->lock);
+    if (!done) return 0;
+
+    if (b->threaded) pthread_join(b->thread,NULL);
+    pthread_mutex_destroy(&b->lock);
+    triFree(E.tri);
+    E.tri = b->idx;
+    struct triSortRow *changed = triRowsSince(b->next_uid,&n);
+    for (int j = 0; j < n; j++) {
+        erow *row = E.row+changed[j].row;
+        triAddRow(E.tri,row->uid,row->chars,row->size);
+    }
+    free(changed);
+    editorSetStatusMessage(
+        "Trigram index: %u trigrams, %.1f MB, built in %.1f ms",
+        E.tri->used, triMemory(E.tri)/(1024.0*1024),
+        (ustime()-b->start)/1000.0);
+    free(b->buf);
+    free(b->off);
+    free(b->len);
+    free(b->uids);
+    free(b);
+    E.tribuild = NULL;
+    return 1;
+}
+
+/* Give the row a new id, since its content changed, and index it. Called
+ * by editorUpdateRow(). */
+void editorTrigramUpdateRow(erow *row) {
+    row->uid = E.next_uid++;
+    if (E.tri == NULL) return;
+    triAddRow(E.tri,row->uid,row->chars,row->size);
+    /* Too many dead ids: build it again. */
+    if (E.tri->nuids > (uint32_t)E.numrows*KILO_TRI_DEAD_RATIO+1024)
+        editorTrigramStart();
+}
+
+/* ===================== Background syntax highlighting ===================== */
+
+/* Highlighting a big file before showing it would take a while, so
+ * editorOpenLoaded() loads it unhighlighted and hands a copy of its
+ * content to a pool of threads, that highlight it a chunk of rows at a
+ * time, starting from the chunk the user is looking at. Meanwhile the
+ * visible rows are highlighted on demand by editorSyntaxCatchUp(). The
+ * threads don't know the state a chunk starts with, so they assume it's
+ * not inside a comment: the rows following a chunk boundary are fixed at
+ * the end, like after an edit. The results are published by the main
+ * thread, while it waits for the user to type, see editorHighlightDrain(). */
+
+#define KILO_HL_BACKGROUND_ROWS 10000   /* Smaller files are done at once. */
+#define KILO_HL_CHUNK_ROWS 1024         /* Rows highlighted per work unit. */
+#define KILO_HL_MAX_THREADS 8
+
+struct hlChunk {
+    int start, end;         /* Rows [start,end) of the job. */
+    int taken;              /* Already assigned to a thread. */
+    unsigned char **hl;     /* Highlight of every row. */
+    unsigned char *oc;      /* Open comment state at the end of every row. */
+    struct hlChunk *next;   /* Next completed chunk. */
+};
+
+struct hlJob {
+    char *buf;              /* The file content, as loaded. */
+    size_t *off;            /* Offset of every row in 'buf'. */
+    int *len;               /* Length of every row. */
+    int first;              /* Index of the first row in E.row. */
+    int rows_gen;           /* E.rows_gen when the rows were loaded. */
+    struct editorSyntax *syntax;
+    struct hlChunk *chunks;
+    int numchunks;
+    int todo;               /* Chunks not yet published. */
+    /* The following fields are protected by 'lock'. */
+    pthread_mutex_t lock;
+    int next;               /* Next chunk to take in file order. */
+    int hot;                /* Chunk under the viewport, served first. */
+    struct hlChunk *done;   /* Completed chunks, not yet published. */
+    pthread_t threads[KILO_HL_MAX_THREADS];
+    int numthreads;
+    uint64_t start;         /* When the job started, in microseconds. */
+};
+
+/* Take the next chunk to highlight: the one under the viewport if it's not
+ * already taken, otherwise the next one in file order. Returns NULL if
+ * there is nothing left. Called with the job lock held. */
+struct hlChunk *editorHighlightTakeChunk(struct hlJob *job) {
+    struct hlChunk *c = NULL;
+
+    if (job->hot < job->numchunks && !job->chunks[job->hot].taken) {
+        c = job->chunks+job->hot;
+    } else {
+        while(job->next < job->numchunks && job->chunks[job->next].taken)
+            job->next++;
+        if (job->next < job->numchunks) c = job->chunks+job->next;
+    }
+    if (c) c->taken = 1;
+    return c;
+}
+
+/* Highlighting thread: highlight chunks until there are none left. */
+void *editorHighlightWorker(void *arg) {
+    struct hlJob *job = arg;
+
+    while(1) {
+        pthread_mutex_lock(&job->lock);
+        struct hlChunk *c = editorHighlightTakeChunk(job);
+        pthread_mutex_unlock(&job->lock);
+        if (c == NULL) break;
+
+        int in_comment = 0, rows = c->end-c->start;
+        c->hl = malloc(sizeof(unsigned char*)*rows);
+        c->oc = malloc(rows);
+        for (int j = 0; j < rows; j++) {
+            int rsize, row = c->start+j;
+            char *render = editorRenderChars(job->buf+job->off[row],
+                                             job->len[row],&rsize);
+            c->hl[j] = malloc(rsize);
+            in_comment = editorHighlightRender(job->syntax,render,rsize,
+                                               c->hl[j],in_comment);
+            c->oc[j] = in_comment;
+            free(render);
+        }
+
+        pthread_mutex_lock(&job->lock);
+        c->next = job->done;
+        job->done = c;
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+/* Start highlighting in background the 'numrows' rows just loaded at index
+ * 'first' of E.row, whose content is at the offsets 'off' of 'buf', with
+ * the lengths 'len'. The job takes ownership of the three arrays. */
+void editorHighlightStart(char *buf, size_t *off, int *len, int first,
+                          int numrows)
+{
+    struct hlJob *job = malloc(sizeof(*job));
+    int j;
+
+    job->buf = buf;
+    job->off = off;
+    job->len = len;
+    job->first = first;
+    job->rows_gen = E.rows_gen;
+    job->syntax = E.syntax;
+    job->numchunks = (numrows+KILO_HL_CHUNK_ROWS-1)/KILO_HL_CHUNK_ROWS;
+    job->chunks = calloc(job->numchunks,sizeof(struct hlChunk));
+    for (j = 0; j < job->numchunks; j++) {
+        job->chunks[j].start = j*KILO_HL_CHUNK_ROWS;
+        job->chunks[j].end = j*KILO_HL_CHUNK_ROWS+KILO_HL_CHUNK_ROWS;
+        if (job->chunks[j].end > numrows) job->chunks[j].end = numrows;
+    }
+    job->todo = job->numchunks;
+    job->next = 0;
+    job->hot = 0;
+    job->done = NULL;
+    job->start = ustime();
+    pthread_mutex_init(&job->lock,NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    if (cpus > KILO_HL_MAX_THREADS) cpus = KILO_HL_MAX_THREADS;
+    if (cpus > job->numchunks) cpus = job->numchunks;
+    job->numthreads = 0;
+    for (j = 0; j < cpus; j++) {
+        if (pthread_create(job->threads+j,NULL,editorHighlightWorker,job))
+            break;
+        job->numthreads++;
+    }
+    E.hljob = job;
+    /* No threads? Do the work here, it will be published as usually. */
+    if (job->numthreads == 0) editorHighlightWorker(job);
+}
+
+/* Called when all the chunks were published: release the job, and fix the
+ * rows after the chunk boundaries, that may have started inside a comment. */
+void editorHighlightFinish(struct hlJob *job) {
+    for (int j = 0; j < job->numthreads; j++)
+        pthread_join(job->threads[j],NULL);
+    pthread_mutex_destroy(&job->lock);
+    free(job->chunks);
+    free(job->buf);
+    free(job->off);
+    free(job->len);
+    E.hljob = NULL;
+    /* If rows were added or removed, or the syntax changed, meanwhile, the
+     * rows still waiting are left to the usual lazy highlighting instead. */
+    if (job->rows_gen == E.rows_gen && job->syntax == E.syntax)
+        editorSyntaxCatchUp(E.numrows-1);
+    free(job);
+}
+
+/* Publish the rows highlighted by the background threads so far, and tell
+ * them where the viewport is. Rows modified in the meantime already have
+ * a fresh highlight, and are left alone. Must be called by the main
+ * thread. Returns 1 if some row changed, so that the caller can refresh
+ * the screen, otherwise 0. */
+int editorHighlightDrain(void) {
+    struct hlJob *job = E.hljob;
+    int changed = 0;
+
+    if (job == NULL) return 0;
+    pthread_mutex_lock(&job->lock);
+    struct hlChunk *c = job->done;
+    job->done = NULL;
+    job->hot = (E.rowoff-job->first)/KILO_HL_CHUNK_ROWS;
+    if (job->hot < 0) job->hot = 0;
+    pthread_mutex_unlock(&job->lock);
+
+    while(c) {
+        int valid = job->rows_gen == E.rows_gen && job->syntax == E.syntax;
+        for (int j = 0; j < c->end-c->start; j++) {
+            erow *row = E.row+job->first+c->start+j;
+            if (valid && row->hl_in == -1) {
+                free(row->hl);
+                row->hl = c->hl[j];
+                row->hl_in = j ? c->oc[j-1] : 0;
+                row->hl_oc = c->oc[j];
+                changed = 1;
+            } else {
+                free(c->hl[j]);
+            }
+        }
+        if (valid) editorSyntaxInvalidate(job->first+c->start);
+        free(c->hl);
+        free(c->oc);
+        job->todo--;
+        c = c->next;
+    }
+    if (job->todo == 0) {
+        editorHighlightFinish(job);
+        changed = 1;
+    }
+    return changed;
+}
+
+/* A file read and split in lines, ready to become the editor rows. */
+struct fileLoad {
+    char *filename;
+    char *buf;          /* The content, lines are NUL terminated in place. */
+    size_t len;
+    int numlines;
+    size_t *off;        /* Offset in 'buf' and length of every line. */
+    int *lens;
+    int err;            /* errno if the file can't be read, else 0. */
+    uint64_t us;        /* Time spent reading and splitting it. */
+};
+
+/* Read the file 'fl->filename' and split it in lines. The editor state is
+ * not touched, so this can run in a thread while the plugins are being
+ * initialized. */
+void editorLoadFile(struct fileLoad *fl) {
+    uint64_t start = ustime();
+    FILE *fp = fopen(fl->filename,"r");
+
+    if (!fp) {
+        fl->err = errno;
+        fl->us = ustime()-start;
+        return;
+    }
+
+    /* Read the whole file at once: if it is big, the highlighting threads
+     * will work on this copy. */
+    size_t len = 0, cap = 65536, nread;
+    char *buf = malloc(cap+1);
+    while((nread = fread(buf+len,1,cap-len,fp)) > 0) {
+        len += nread;
+        if (len == cap) {
+            cap *= 2;
+            buf = realloc(buf,cap+1);
+        }
+    }
+    fclose(fp);
+
+    int numlines = 0;
+    char *p = buf, *nl;
+    while((nl = memchr(p,'\n',len-(p-buf))) != NULL) {
+        numlines++;
+        p = nl+1;
+    }
+    if ((size_t)(p-buf) < len) numlines++; /* No newline at the end. */
+
+    size_t *off = malloc(sizeof(size_t)*(numlines ? numlines : 1));
+    int *lens = malloc(sizeof(int)*(numlines ? numlines : 1));
+    p = buf;
+    for (int j = 0; j < numlines; j++) {
+        size_t linelen;
+        nl = memchr(p,'\n',len-(p-buf));
+        linelen = nl ? (size_t)(nl-p) : len-(p-buf);
+        if (!nl && linelen && p[linelen-1] == '\r') linelen--;
+        p[linelen] = '\0';
+        off[j] = p-buf;
+        lens[j] = linelen;
+        p = nl ? nl+1 : buf+len;
+    }
+
+    fl->buf = buf;
+    fl->len = len;
+    fl->numlines = numlines;
+    fl->off = off;
+    fl->lens = lens;
+    fl->us = ustime()-start;
 }
 
-/* Load the specified program in the editor memory and returns 0 on success
- * or 1 on error. */
-int editorOpen(char *filename) {
-    FILE *fp;
+void *editorLoadFileThread(void *arg) {
+    editorLoadFile(arg);
+    return NULL;
+}
 
+/* Make the file loaded in 'fl' the content of the editor. Returns 0 on
+ * success or 1 on error, that is, if the file doesn't exist yet. */
+int editorOpenLoaded(struct fileLoad *fl) {
     E.dirty = 0;
     free(E.filename);
-    size_t fnlen = strlen(filename)+1;
+    size_t fnlen = strlen(fl->filename)+1;
     E.filename = malloc(fnlen);
-    memcpy(E.filename,filename,fnlen);
+    memcpy(E.filename,fl->filename,fnlen);
 
-    fp = fopen(filename,"r");
-    if (!fp) {
-        if (errno != ENOENT) {
+    if (fl->err) {
+        if (fl->err != ENOENT) {
+            errno = fl->err;
             perror("Opening file");
             exit(1);
         }
         return 1;
     }
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while((linelen = getline(&line,&linecap,fp)) != -1) {
-        if (linelen && (line[linelen-1] == '\n' || line[linelen-1] == '\r'))
-            line[--linelen] = '\0';
-        editorInsertRow(E.numrows,line,linelen);
+    int numlines = fl->numlines;
+    int background = !E.batch && E.syntax &&
+                     numlines >= KILO_HL_BACKGROUND_ROWS;
+    int first = E.numrows;
+
+    E.hl_deferred = background;
+    for (int j = 0; j < numlines; j++)
+        editorInsertRow(E.numrows,fl->buf+fl->off[j],fl->lens[j]);
+    E.hl_deferred = 0;
+
+    if (background) {
+        E.hl_stale = first;
+        editorHighlightStart(fl->buf,fl->off,fl->lens,first,numlines);
+    } else {
+        free(fl->buf);
+        free(fl->off);
+        free(fl->lens);
     }
-    free(line);
-    fclose(fp);
     E.dirty = 0;
+    if (!E.batch) editorTrigramStart();
     return 0;
 }
 
@@ -1366,12 +4702,19 @@ void abFree(struct abuf *ab) {
 
 /* This function writes the whole screen using VT100 escape characters
  * starting from the logical state of the editor in the global state 'E'. */
+unsigned char *editorFindOverlay(int filerow, unsigned char *hl, int len);
+
 void editorRefreshScreen(void) {
     int y;
     erow *r;
     char buf[32];
     struct abuf ab = ABUF_INIT;
 
+    if (E.norefresh) return;
+
+    /* Fix the highlight of the rows we are going to show, if stale. */
+    editorSyntaxCatchUp(E.rowoff+E.screenrows-1);
+
     abAppend(&ab,"\x1b[?25l",6); /* Hide cursor. */
     abAppend(&ab,"\x1b[H",3); /* Go home. */
     for (y = 0; y < E.screenrows; y++) {
@@ -1402,8 +4745,13 @@ void editorRefreshScreen(void) {
         if (len > 0) {
             if (len > E.screencols) len = E.screencols;
             char *c = r->render+E.coloff;
-            unsigned char *hl = r->hl+E.coloff;
+            unsigned char *hl = r->hl+E.coloff, *overlay = NULL;
             int j;
+
+            /* Matches of the find query are drawn over the syntax
+             * highlight, without touching it. */
+            if (E.find) overlay = editorFindOverlay(filerow,hl,len);
+            if (overlay) hl = overlay;
             for (j = 0; j < len; j++) {
                 if (hl[j] == HL_NONPRINT) {
                     char sym;
@@ -1431,88 +4779,1287 @@ void editorRefreshScreen(void) {
                     abAppend(&ab,c+j,1);
                 }
             }
+            free(overlay);
+        }
+        abAppend(&ab,"\x1b[39m",5);
+        abAppend(&ab,"\x1b[0K",4);
+        abAppend(&ab,"\r\n",2);
+    }
+
+    /* Create a two rows status. First row: */
+    abAppend(&ab,"\x1b[0K",4);
+    abAppend(&ab,"\x1b[7m",4);
+    char status[80], rstatus[80];
+    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+        E.filename, E.numrows, E.dirty ? "(modified)" : "");
+    int rlen = snprintf(rstatus, sizeof(rstatus),
+        "%d/%d",E.rowoff+E.cy+1,E.numrows);
+    if (len > E.screencols) len = E.screencols;
+    abAppend(&ab,status,len);
+    while(len < E.screencols) {
+        if (E.screencols - len == rlen) {
+            abAppend(&ab,rstatus,rlen);
+            break;
+        } else {
+            abAppend(&ab," ",1);
+            len++;
+        }
+    }
+    abAppend(&ab,"\x1b[0m\r\n",6);
+
+    /* Second row depends on E.statusmsg and the status message update time. */
+    abAppend(&ab,"\x1b[0K",4);
+    int msglen = strlen(E.statusmsg);
+    if (msglen && time(NULL)-E.statusmsg_time < 5)
+        abAppend(&ab,E.statusmsg,msglen <= E.screencols ? msglen : E.screencols);
+
+    /* Put cursor at its current position. Note that the horizontal position
+     * at which the cursor is displayed may be different compared to 'E.cx'
+     * because of TABs. */
+    int j;
+    int cx = 1;
+    int filerow = E.rowoff+E.cy;
+    erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+    if (row) {
+        for (j = E.coloff; j < (E.cx+E.coloff); j++) {
+            if (j < row->size && row->chars[j] == TAB) cx += 7-((cx)%8);
+            cx++;
+        }
+    }
+    snprintf(buf,sizeof(buf),"\x1b[%d;%dH",E.cy+1,cx);
+    abAppend(&ab,buf,strlen(buf));
+    abAppend(&ab,"\x1b[?25h",6); /* Show cursor. */
+    write(STDOUT_FILENO,ab.b,ab.len);
+    abFree(&ab);
+}
+
+/* Set an editor status message for the second line of the status, at the
+ * end of the screen. */
+void editorSetStatusMessage(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap,fmt);
+    vsnprintf(E.statusmsg,sizeof(E.statusmsg),fmt,ap);
+    va_end(ap);
+    E.statusmsg_time = time(NULL);
+    /* Nobody is going to see the status bar in batch mode. */
+    if (E.batch && E.statusmsg[0]) fprintf(stderr,"Status: %s\n",E.statusmsg);
+}
+
+/* ============================== Search engine ============================= */
+
+/* Literal searches run directly over the rows content (not the rendered
+ * version), with the query compiled once. With SSE2, 16 positions at a time
+ * are compared against the first and the last byte of the pattern, and only
+ * the positions matching both are verified. Otherwise the Boyer-Moore-
+ * Horspool skip table is used. Case insensitive queries compare against
+ * both the cases of those bytes. */
+
+#define KILO_QUERY_LEN 256
+
+#define SEARCH_ICASE (1<<0)     /* Ignore case. */
+#define SEARCH_WORD (1<<1)      /* Only match whole words. */
+#define SEARCH_REGEX (1<<2)     /* The query is a regular expression. */
+
+struct searchQuery {
+    unsigned char pat[KILO_QUERY_LEN];  /* Lowercase if SEARCH_ICASE. */
+    int len;
+    int flags;
+    int skip[256];      /* Horspool shift for every byte. */
+};
+
+/* Compile the pattern 'pat' of length 'len' (at most KILO_QUERY_LEN) into
+ * the query 'q'. 'flags' are the SEARCH_* flags. */
+void searchCompile(struct searchQuery *q, const char *pat, int len,
+                   int flags)
+{
+    int j, icase = flags & SEARCH_ICASE;
+
+    if (len > KILO_QUERY_LEN) len = KILO_QUERY_LEN;
+    q->len = len;
+    q->flags = flags;
+    for (j = 0; j < len; j++) {
+        unsigned char c = pat[j];
+        q->pat[j] = icase ? tolower(c) : c;
+    }
+    for (j = 0; j < 256; j++) q->skip[j] = len;
+    for (j = 0; j < len-1; j++) {
+        q->skip[q->pat[j]] = len-1-j;
+        if (icase) q->skip[toupper(q->pat[j])] = len-1-j;
+    }
+}
+
+/* Return 1 if the pattern matches at 'p', otherwise 0. */
+static inline int searchVerify(struct searchQuery *q, const char *p) {
+    if (!(q->flags & SEARCH_ICASE)) return !memcmp(p,q->pat,q->len);
+    for (int j = 0; j < q->len; j++)
+        if (tolower((unsigned char)p[j]) != q->pat[j]) return 0;
+    return 1;
+}
+
+/* Return the offset of the first occurrence of the pattern in the 'len'
+ * bytes at 's', starting at offset 'from', or -1 if there is none. Whole
+ * word matching is not considered here, see searchRow(). */
+int searchFind(struct searchQuery *q, const char *s, int len, int from) {
+    int m = q->len, i = from, icase = q->flags & SEARCH_ICASE;
+
+    if (m == 0 || i < 0 || len-i < m) return -1;
+    unsigned char first = q->pat[0], last = q->pat[m-1];
+    if (m <= 2 && !icase) {
+        /* Too short to skip much: libc's memchr() is faster. */
+        const char *p = s+i, *end = s+len-m+1;
+        while((p = memchr(p,first,end-p)) != NULL) {
+            if (m == 1 || p[1] == (char)last) return p-s;
+            p++;
+        }
+        return -1;
+    }
+#if defined(__SSE2__)
+    const __m128i f1 = _mm_set1_epi8(first),
+                  f2 = _mm_set1_epi8(icase ? toupper(first) : first),
+                  l1 = _mm_set1_epi8(last),
+                  l2 = _mm_set1_epi8(icase ? toupper(last) : last);
+    for (; i+m-1+16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s+i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s+i+m-1));
+        __m128i hit = _mm_and_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(a,f1),_mm_cmpeq_epi8(a,f2)),
+            _mm_or_si128(_mm_cmpeq_epi8(b,l1),_mm_cmpeq_epi8(b,l2)));
+        unsigned int mask = _mm_movemask_epi8(hit);
+        while(mask) {
+            int off = i+__builtin_ctz(mask);
+            if (searchVerify(q,s+off)) return off;
+            mask &= mask-1;
+        }
+    }
+#endif
+    /* Horspool: what SSE2 left, or everything. */
+    while(i+m <= len) {
+        unsigned char c = s[i+m-1];
+        if ((icase ? tolower(c) : c) == last && searchVerify(q,s+i))
+            return i;
+        i += q->skip[c];
+    }
+    return -1;
+}
+
+/* Return 1 if the match at offset 'off' of the row content 's' of length
+ * 'len' is not part of a longer word, otherwise 0. */
+int searchIsWord(struct searchQuery *q, const char *s, int len, int off) {
+    int end = off+q->len;
+    if (off > 0 && (HLCLASS(q->pat[0]) & HLC_WORD) &&
+        (HLCLASS(s[off-1]) & HLC_WORD)) return 0;
+    if (end < len && (HLCLASS(q->pat[q->len-1]) & HLC_WORD) &&
+        (HLCLASS(s[end]) & HLC_WORD)) return 0;
+    return 1;
+}
+
+/* Store in 'offs' the offsets of the matches of the query in the 'len'
+ * bytes at 's', up to 'max' of them. Matches don't overlap. Returns the
+ * number of matches stored. */
+int searchRow(struct searchQuery *q, const char *s, int len, int *offs,
+              int max)
+{
+    int n = 0, i = 0;
+
+    while(n < max && (i = searchFind(q,s,len,i)) != -1) {
+        if (!(q->flags & SEARCH_WORD) || searchIsWord(q,s,len,i)) {
+            offs[n++] = i;
+            i += q->len;
+        } else {
+            i++;
+        }
+    }
+    return n;
+}
+
+/* Incremental search: when the query grows, only the rows matching the
+ * shorter query can match the longer one, so only those are checked. The
+ * rows matching the previous queries are kept in a stack, so that deleting
+ * the last char of the query gets them back for free. The candidate rows
+ * are computed with plain substring matching, whole word matching is left
+ * to the caller. */
+
+#define SEARCH_STACK_LEN 16
+
+/* The rows matching a query. */
+struct searchCands {
+    int *rows;      /* Matching rows, in ascending order. */
+    int len;        /* Number of rows. */
+    int qlen;       /* Length of the query. */
+};
+
+struct searchNarrowing {
+    struct searchCands stack[SEARCH_STACK_LEN];
+    int depth;      /* Sets in the stack. The top one is the last query. */
+    int version;    /* E.version when the sets were computed. */
+    int icase;      /* Were they computed ignoring case? */
+};
+
+/* Drop the candidate sets of 'n' from the top of the stack. */
+void searchNarrowingPop(struct searchNarrowing *sn, int count) {
+    while(count-- > 0 && sn->depth > 0)
+        free(sn->stack[--sn->depth].rows);
+}
+
+/* A match of a find query. */
+struct searchMatch {
+    int row;        /* Row index. */
+    int off;        /* Offset in the row content. */
+    int len;        /* Length in bytes. */
+};
+
+/* All the matches of a query in the buffer, sorted by position. */
+struct searchIndex {
+    struct searchMatch *m;
+    int len;
+    int version;    /* E.version when the matches were collected. */
+};
+
+void searchScan(int *rows, int nrows, struct searchQuery *q, char *pat,
+                int patlen, int flags, struct searchCands *cands,
+                struct searchIndex *idx);
+int editorTrigramCandidates(const char *query, int qlen, int **rows);
+
+/* Return the rows where the query 'query' of length 'qlen' may match (all
+ * of the rows where it matches ignoring SEARCH_WORD) with the given
+ * SEARCH_* flags, and store in 'idx' its matches. The query is expected to
+ * differ from the one of the previous call by chars added or removed at
+ * the end. */
+struct searchCands *searchNarrow(struct searchNarrowing *sn, char *query,
+                                 int qlen, int flags, struct searchIndex *idx)
+{
+    int icase = flags & SEARCH_ICASE;
+    struct searchQuery q;
+
+    /* Sets computed on different rows, or for a different kind of
+     * match, are useless. */
+    if (sn->version != E.version || sn->icase != icase) {
+        searchNarrowingPop(sn,sn->depth);
+        sn->version = E.version;
+        sn->icase = icase;
+    }
+    /* Sets of longer queries are for chars that were deleted. */
+    while(sn->depth && sn->stack[sn->depth-1].qlen > qlen)
+        searchNarrowingPop(sn,1);
+    searchCompile(&q,query,qlen,flags);
+    if (sn->depth && sn->stack[sn->depth-1].qlen == qlen) {
+        struct searchCands *top = sn->stack+sn->depth-1;
+        searchScan(top->rows,top->len,&q,NULL,0,flags,NULL,idx);
+        return top;
+    }
+
+    /* Filter the rows of the longest prefix we know about, or the rows
+     * the trigram index selects, whatever is less, or all of them. */
+    struct searchCands *from = sn->depth ? sn->stack+sn->depth-1 : NULL;
+    struct searchCands c;
+    int *rows = from ? from->rows : NULL, n = from ? from->len : E.numrows;
+    int *trirows = NULL, ntri = editorTrigramCandidates(query,qlen,&trirows);
+
+    if (ntri != -1 && ntri < n) {
+        rows = trirows;
+        n = ntri;
+    }
+    c.rows = malloc(sizeof(int)*(n ? n : 1));
+    c.len = 0;
+    c.qlen = qlen;
+    searchScan(rows,n,&q,NULL,0,flags,&c,idx);
+    free(trirows);
+    if (sn->depth == SEARCH_STACK_LEN) {
+        /* Full: forget the oldest set. */
+        free(sn->stack[0].rows);
+        memmove(sn->stack,sn->stack+1,sizeof(c)*(SEARCH_STACK_LEN-1));
+        sn->depth--;
+    }
+    sn->stack[sn->depth++] = c;
+    return sn->stack+sn->depth-1;
+}
+
+/* ========================== Regular expressions =========================== */
+
+/* Regular expressions are compiled into the program of a Thompson NFA. The
+ * program is never run by backtracking, so the time to match a row is
+ * always linear in its length, whatever the pattern. To tell if a row
+ * matches at all (the common case when searching a big file) the NFA is run
+ * as a DFA, whose states (sets of NFA states) are built lazily and cached:
+ * after a short warm up every byte costs a table lookup. Only the rows that
+ * match are run again with a Pike VM, that simulates the NFA threads in
+ * priority order to find the leftmost match and its groups, with the usual
+ * Perl semantics.
+ *
+ * The syntax is the common subset: . [abc] [^a-z] \d \w \s \D \W \S, the
+ * anchors ^ and $, alternation with |, the * + ? {n} {n,} {n,m} repetitions
+ * (lazy with a trailing ?), capturing groups (...) and non capturing ones
+ * (?:...). A leading (?i) makes the match case insensitive.
+ *
+ * A compiled regex keeps its DFA cache and work memory, so it must be used
+ * by a single thread at a time. */
+
+#define RE_MAX_INST 5000        /* Max size of a compiled program. */
+#define RE_MAX_GROUPS 10        /* Max capturing groups, whole match included. */
+#define RE_DFA_MAX_STATES 1000  /* DFA states cached before a flush. */
+
+/* Syntax tree node types. */
+#define RE_SET 0        /* A byte out of a set. */
+#define RE_CAT 1        /* 'a' followed by 'b'. */
+#define RE_ALT 2        /* 'a' or 'b'. */
+#define RE_REPEAT 3     /* 'a' from 'min' to 'max' (-1 if unbounded) times. */
+#define RE_GROUP 4      /* 'a', captured as 'group' if not -1. */
+#define RE_BOL 5
+#define RE_EOL 6
+#define RE_EMPTY 7
+
+struct reNode {
+    int type;
+    int a, b;           /* Children, as indexes of the nodes array. */
+    int set;            /* RE_SET: index of the byte set. */
+    int min, max;       /* RE_REPEAT. */
+    int greedy;         /* RE_REPEAT: prefer more repetitions? */
+    int group;          /* RE_GROUP. */
+};
+
+struct reParser {
+    const char *p, *end;
+    int icase;
+    struct reNode *nodes;
+    int nnodes;
+    unsigned char (*sets)[32];  /* Byte sets, as bitmaps. */
+    int nsets;
+    int ngroups;
+    const char *err;
+};
+
+/* Program instructions. */
+#define RI_SET 0        /* Consume a byte of the set 'x'. */
+#define RI_SPLIT 1      /* Go on at 'x' and, with lower priority, at 'y'. */
+#define RI_JMP 2        /* Go on at 'x'. */
+#define RI_SAVE 3       /* Store the position in the capture slot 'x'. */
+#define RI_BOL 4
+#define RI_EOL 5
+#define RI_MATCH 6
+
+struct reInst {
+    int op, x, y;
+};
+
+/* A state of the lazy DFA. */
+struct reDState {
+    int *pcs;           /* NFA states, sorted. Only RI_SET, RI_EOL, RI_MATCH. */
+    int npcs;
+    int match;          /* A match ended before the current byte. */
+    int match_end;      /* A match ends here if the row does. */
+    int next[256];      /* Next state for every byte, -1 if not known yet. */
+};
+
+struct regex {
+    struct reInst *prog;
+    int len;
+    unsigned char (*sets)[32];
+    int nsets;
+    int ngroups;        /* Capturing groups, the whole match included. */
+    /* Lazy DFA. */
+    struct reDState *dstates;
+    int ndstates;
+    int *dhash;         /* Hash table of DFA states indexes, -1 if empty. */
+    int dhashsize;
+    int dstart;         /* State at the start of a row. */
+    /* Work memory. */
+    int *list;          /* NFA states being collected. */
+    int *stack;
+    int *mark;          /* Generation an NFA state was last visited at. */
+    int gen;
+    int *tpc[2];        /* Pike VM thread lists: states and captures. */
+    int *tcaps[2];
+    int tlen[2];
+};
+
+#define RE_SET_HAS(set,c) ((set)[(unsigned char)(c)>>3] & (1<<((c)&7)))
+
+int reNewNode(struct reParser *ps, int type) {
+    ps->nodes = realloc(ps->nodes,sizeof(struct reNode)*(ps->nnodes+1));
+    struct reNode *n = ps->nodes+ps->nnodes;
+    memset(n,0,sizeof(*n));
+    n->type = type;
+    n->group = -1;
+    return ps->nnodes++;
+}
+
+int reNewSet(struct reParser *ps) {
+    ps->sets = realloc(ps->sets,sizeof(ps->sets[0])*(ps->nsets+1));
+    memset(ps->sets[ps->nsets],0,sizeof(ps->sets[0]));
+    return ps->nsets++;
+}
+
+/* Add the byte 'c' to the set 'set', in both cases if ignoring case. */
+void reSetAdd(struct reParser *ps, int set, int c) {
+    ps->sets[set][c>>3] |= 1<<(c&7);
+    if (ps->icase && isalpha(c)) {
+        int o = islower(c) ? toupper(c) : tolower(c);
+        ps->sets[set][o>>3] |= 1<<(o&7);
+    }
+}
+
+/* Add to the set the bytes of the class escape \'c' (like \d). Returns 0
+ * if 'c' is not a class escape, otherwise 1. */
+int reSetAddClass(struct reParser *ps, int set, int c) {
+    int neg = isupper(c), b;
+    switch(tolower(c)) {
+    case 'd': case 'w': case 's': break;
+    default: return 0;
+    }
+    for (b = 0; b < 256; b++) {
+        int in;
+        switch(tolower(c)) {
+        case 'd': in = isdigit(b); break;
+        case 'w': in = isalnum(b) || b == '_'; break;
+        default: in = isspace(b); break;
+        }
+        if ((in != 0) != neg) ps->sets[set][b>>3] |= 1<<(b&7);
+    }
+    return 1;
+}
+
+/* Return the byte the escape \'c' stands for (like \t), or 'c' itself. */
+int reEscapeByte(int c) {
+    switch(c) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    default: return c;
+    }
+}
+
+int reParseAlt(struct reParser *ps);
+
+/* Parse a bracket expression like [^a-z_], the '[' already consumed. */
+int reParseClass(struct reParser *ps) {
+    int set = reNewSet(ps), neg = 0, first = 1;
+    unsigned char tmp[32];
+
+    if (ps->p < ps->end && *ps->p == '^') {
+        neg = 1;
+        ps->p++;
+    }
+    while(ps->p < ps->end && (*ps->p != ']' || first)) {
+        int c = (unsigned char)*ps->p++;
+        first = 0;
+        if (c == '\\' && ps->p < ps->end) {
+            c = (unsigned char)*ps->p++;
+            if (reSetAddClass(ps,set,c)) continue;
+            c = reEscapeByte(c);
+        }
+        if (ps->p+1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+            int hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' && ps->p < ps->end)
+                hi = reEscapeByte((unsigned char)*ps->p++);
+            if (hi < c) {
+                ps->err = "bad range in []";
+                return -1;
+            }
+            for (; c <= hi; c++) reSetAdd(ps,set,c);
+        } else {
+            reSetAdd(ps,set,c);
+        }
+    }
+    if (ps->p == ps->end) {
+        ps->err = "missing ]";
+        return -1;
+    }
+    ps->p++;
+    if (neg) {
+        memcpy(tmp,ps->sets[set],32);
+        for (int j = 0; j < 32; j++) ps->sets[set][j] = ~tmp[j];
+    }
+    int n = reNewNode(ps,RE_SET);
+    ps->nodes[n].set = set;
+    return n;
+}
+
+/* Parse a single atom: a byte, a class, an anchor or a group. */
+int reParseAtom(struct reParser *ps) {
+    int c = (unsigned char)*ps->p++, n, set;
+
+    switch(c) {
+    case '(': {
+        int group = -1;
+        if (ps->end-ps->p >= 2 && ps->p[0] == '?' && ps->p[1] == ':') {
+            ps->p += 2;
+        } else {
+            if (ps->ngroups == RE_MAX_GROUPS) {
+                ps->err = "too many groups";
+                return -1;
+            }
+            group = ps->ngroups++;
+        }
+        int a = reParseAlt(ps);
+        if (a == -1) return -1;
+        if (ps->p == ps->end || *ps->p != ')') {
+            ps->err = "missing )";
+            return -1;
+        }
+        ps->p++;
+        n = reNewNode(ps,RE_GROUP);
+        ps->nodes[n].a = a;
+        ps->nodes[n].group = group;
+        return n;
+    }
+    case '[':
+        return reParseClass(ps);
+    case '^':
+        return reNewNode(ps,RE_BOL);
+    case '$':
+        return reNewNode(ps,RE_EOL);
+    case '*': case '+': case '?':
+        ps->err = "nothing to repeat";
+        return -1;
+    }
+
+    set = reNewSet(ps);
+    if (c == '.') {
+        memset(ps->sets[set],0xff,32);
+    } else if (c == '\\') {
+        if (ps->p == ps->end) {
+            ps->err = "trailing \\";
+            return -1;
+        }
+        c = (unsigned char)*ps->p++;
+        if (!reSetAddClass(ps,set,c)) reSetAdd(ps,set,reEscapeByte(c));
+    } else {
+        reSetAdd(ps,set,c);
+    }
+    n = reNewNode(ps,RE_SET);
+    ps->nodes[n].set = set;
+    return n;
+}
+
+/* Parse the number at the current position, or return -1. */
+int reParseNum(struct reParser *ps) {
+    int n = -1;
+    while(ps->p < ps->end && isdigit((unsigned char)*ps->p)) {
+        n = (n == -1 ? 0 : n*10) + (*ps->p++ - '0');
+        if (n > RE_MAX_INST) n = RE_MAX_INST; /* Too big anyway. */
+    }
+    return n;
+}
+
+/* Parse an atom followed by any number of repetition operators. */
+int reParseRepeat(struct reParser *ps) {
+    int a = reParseAtom(ps);
+
+    while(a != -1 && ps->p < ps->end) {
+        int min, max, c = *ps->p;
+        if (c == '*') {
+            min = 0; max = -1;
+        } else if (c == '+') {
+            min = 1; max = -1;
+        } else if (c == '?') {
+            min = 0; max = 1;
+        } else if (c == '{') {
+            const char *save = ps->p++;
+            min = reParseNum(ps);
+            max = min;
+            if (ps->p < ps->end && *ps->p == ',') {
+                ps->p++;
+                max = reParseNum(ps);
+            }
+            if (min == -1 || ps->p == ps->end || *ps->p != '}' ||
+                (max != -1 && max < min))
+            {
+                /* Not a repetition: a literal '{'. */
+                ps->p = save;
+                break;
+            }
+        } else {
+            break;
+        }
+        ps->p++;
+        int n = reNewNode(ps,RE_REPEAT);
+        ps->nodes[n].a = a;
+        ps->nodes[n].min = min;
+        ps->nodes[n].max = max;
+        ps->nodes[n].greedy = 1;
+        if (ps->p < ps->end && *ps->p == '?') {
+            ps->nodes[n].greedy = 0;
+            ps->p++;
+        }
+        a = n;
+    }
+    return a;
+}
+
+/* Parse a sequence of atoms, up to a '|' or ')'. */
+int reParseCat(struct reParser *ps) {
+    int n = -1;
+
+    while(ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        int a = reParseRepeat(ps);
+        if (a == -1) return -1;
+        if (n == -1) {
+            n = a;
+        } else {
+            int cat = reNewNode(ps,RE_CAT);
+            ps->nodes[cat].a = n;
+            ps->nodes[cat].b = a;
+            n = cat;
+        }
+    }
+    return n == -1 ? reNewNode(ps,RE_EMPTY) : n;
+}
+
+int reParseAlt(struct reParser *ps) {
+    int n = reParseCat(ps);
+
+    while(n != -1 && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        int b = reParseCat(ps);
+        if (b == -1) return -1;
+        int alt = reNewNode(ps,RE_ALT);
+        ps->nodes[alt].a = n;
+        ps->nodes[alt].b = b;
+        n = alt;
+    }
+    return n;
+}
+
+/* Append an instruction to the program. Returns its address, or -1 if the
+ * program is too big. */
+int reEmit(struct regex *re, int op, int x, int y) {
+    if (re->len == RE_MAX_INST) return -1;
+    re->prog[re->len].op = op;
+    re->prog[re->len].x = x;
+    re->prog[re->len].y = y;
+    return re->len++;
+}
+
+/* Compile the node 'n' and its children. Returns -1 if the program gets
+ * too big, otherwise 0. */
+int reCompileNode(struct regex *re, struct reNode *nodes, int n) {
+    struct reNode *node = nodes+n;
+    int pc, j;
+
+    switch(node->type) {
+    case RE_SET:
+        return reEmit(re,RI_SET,node->set,0) == -1 ? -1 : 0;
+    case RE_BOL:
+        return reEmit(re,RI_BOL,0,0) == -1 ? -1 : 0;
+    case RE_EOL:
+        return reEmit(re,RI_EOL,0,0) == -1 ? -1 : 0;
+    case RE_EMPTY:
+        return 0;
+    case RE_CAT:
+        if (reCompileNode(re,nodes,node->a) == -1) return -1;
+        return reCompileNode(re,nodes,node->b);
+    case RE_GROUP:
+        if (node->group == -1) return reCompileNode(re,nodes,node->a);
+        if (reEmit(re,RI_SAVE,node->group*2,0) == -1 ||
+            reCompileNode(re,nodes,node->a) == -1 ||
+            reEmit(re,RI_SAVE,node->group*2+1,0) == -1) return -1;
+        return 0;
+    case RE_ALT: {
+        /* split L1, L2; L1: a; jmp end; L2: b; end: */
+        int split = reEmit(re,RI_SPLIT,0,0), jmp;
+        if (split == -1) return -1;
+        re->prog[split].x = re->len;
+        if (reCompileNode(re,nodes,node->a) == -1) return -1;
+        if ((jmp = reEmit(re,RI_JMP,0,0)) == -1) return -1;
+        re->prog[split].y = re->len;
+        if (reCompileNode(re,nodes,node->b) == -1) return -1;
+        re->prog[jmp].x = re->len;
+        return 0;
+    }
+    case RE_REPEAT: {
+        /* The mandatory copies first. */
+        for (j = 0; j < node->min; j++)
+            if (reCompileNode(re,nodes,node->a) == -1) return -1;
+        if (node->max == -1) {
+            /* L: split body, end; body: a; jmp L; end: */
+            int split = reEmit(re,RI_SPLIT,0,0);
+            if (split == -1) return -1;
+            if (reCompileNode(re,nodes,node->a) == -1) return -1;
+            if (reEmit(re,RI_JMP,split,0) == -1) return -1;
+            re->prog[split].x = node->greedy ? split+1 : re->len;
+            re->prog[split].y = node->greedy ? re->len : split+1;
+            return 0;
+        }
+        /* Then the optional ones: split body, end; body: a; ...
+         * All the splits jump to the same end, patched later. */
+        int count = node->max-node->min;
+        int *splits = malloc(sizeof(int)*(count ? count : 1));
+        for (j = 0; j < count; j++) {
+            if ((pc = reEmit(re,RI_SPLIT,0,0)) == -1 ||
+                reCompileNode(re,nodes,node->a) == -1)
+            {
+                free(splits);
+                return -1;
+            }
+            splits[j] = pc;
+        }
+        for (j = 0; j < count; j++) {
+            re->prog[splits[j]].x = node->greedy ? splits[j]+1 : re->len;
+            re->prog[splits[j]].y = node->greedy ? re->len : splits[j]+1;
+        }
+        free(splits);
+        return 0;
+    }
+    }
+    return -1;
+}
+
+void regexFree(struct regex *re) {
+    if (re == NULL) return;
+    for (int j = 0; j < re->ndstates; j++) free(re->dstates[j].pcs);
+    free(re->dstates);
+    free(re->dhash);
+    free(re->prog);
+    free(re->sets);
+    free(re->list);
+    free(re->stack);
+    free(re->mark);
+    for (int j = 0; j < 2; j++) {
+        free(re->tpc[j]);
+        free(re->tcaps[j]);
+    }
+    free(re);
+}
+
+/* Drop all the DFA states, and create the start state. */
+void reDFAReset(struct regex *re) {
+    for (int j = 0; j < re->ndstates; j++) free(re->dstates[j].pcs);
+    re->ndstates = 0;
+    for (int j = 0; j < re->dhashsize; j++) re->dhash[j] = -1;
+}
+
+/* Add to re->list the NFA states reachable from 'pc' without consuming
+ * bytes, that are the ones consuming a byte, matching, or waiting for the
+ * end of the row. 'bol' and 'eol' tell if we are at the start or at the
+ * end of the row. States are visited once per generation (re->gen). */
+void reClosure(struct regex *re, int pc, int bol, int eol, int *n) {
+    int sp = 0;
+
+    re->stack[sp++] = pc;
+    while(sp) {
+        pc = re->stack[--sp];
+        if (re->mark[pc] == re->gen) continue;
+        re->mark[pc] = re->gen;
+        struct reInst *in = re->prog+pc;
+        switch(in->op) {
+        case RI_JMP: re->stack[sp++] = in->x; break;
+        case RI_SPLIT:
+            re->stack[sp++] = in->y;
+            re->stack[sp++] = in->x;
+            break;
+        case RI_SAVE: re->stack[sp++] = pc+1; break;
+        case RI_BOL: if (bol) re->stack[sp++] = pc+1; break;
+        case RI_EOL:
+            if (eol) re->stack[sp++] = pc+1;
+            else re->list[(*n)++] = pc;
+            break;
+        default: re->list[(*n)++] = pc; break;
+        }
+    }
+}
+
+int reIntCmp(const void *a, const void *b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+/* Return the index of the DFA state for the NFA states 'pcs', creating it
+ * if needed. If the cache is full it is flushed first: the indexes of the
+ * states the caller knows, re->dstart included, are no longer valid. */
+int reDStateFor(struct regex *re, int *pcs, int npcs) {
+    uint32_t h = 2166136261u;
+    int j, slot;
+
+    qsort(pcs,npcs,sizeof(int),reIntCmp);
+    for (j = 0; j < npcs; j++) h = (h ^ pcs[j])*16777619u;
+    slot = h & (re->dhashsize-1);
+    while(re->dhash[slot] != -1) {
+        struct reDState *d = re->dstates+re->dhash[slot];
+        if (d->npcs == npcs && !memcmp(d->pcs,pcs,sizeof(int)*npcs))
+            return re->dhash[slot];
+        slot = (slot+1) & (re->dhashsize-1);
+    }
+    if (re->ndstates >= RE_DFA_MAX_STATES) {
+        reDFAReset(re);
+        re->dstart = -1;
+        slot = h & (re->dhashsize-1);
+    }
+
+    struct reDState *d = re->dstates+re->ndstates;
+    d->pcs = malloc(sizeof(int)*(npcs ? npcs : 1));
+    memcpy(d->pcs,pcs,sizeof(int)*npcs);
+    d->npcs = npcs;
+    d->match = d->match_end = 0;
+    for (j = 0; j < 256; j++) d->next[j] = -1;
+    for (j = 0; j < npcs; j++)
+        if (re->prog[pcs[j]].op == RI_MATCH) d->match = d->match_end = 1;
+    if (!d->match) {
+        /* Would a match end if the row ended here? Note that 'pcs' may
+         * be re->list itself, so from now on only d->pcs is used. */
+        int n = 0;
+        re->gen++;
+        for (j = 0; j < npcs; j++)
+            if (re->prog[d->pcs[j]].op == RI_EOL)
+                reClosure(re,d->pcs[j]+1,0,1,&n);
+        for (j = 0; j < n; j++)
+            if (re->prog[re->list[j]].op == RI_MATCH) d->match_end = 1;
+    }
+    re->dhash[slot] = re->ndstates;
+    return re->ndstates++;
+}
+
+/* Compute the DFA transition from the state 'from' with the byte 'c'. The
+ * states reachable at the start of a match are always added, since a
+ * match may start at any position. */
+int reDStep(struct regex *re, int from, int c) {
+    if (re->ndstates >= RE_DFA_MAX_STATES) {
+        /* The cache is full: start over, keeping just the current state,
+         * so that 'from' is still valid once the next state is added. */
+        int npcs = re->dstates[from].npcs;
+        int *pcs = malloc(sizeof(int)*(npcs ? npcs : 1));
+        memcpy(pcs,re->dstates[from].pcs,sizeof(int)*npcs);
+        reDFAReset(re);
+        memcpy(re->list,pcs,sizeof(int)*npcs);
+        free(pcs);
+        re->dstart = -1;
+        from = reDStateFor(re,re->list,npcs);
+    }
+
+    struct reDState *d = re->dstates+from;
+    int n = 0, next;
+    re->gen++;
+    for (int j = 0; j < d->npcs; j++) {
+        struct reInst *in = re->prog+d->pcs[j];
+        if (in->op == RI_SET && RE_SET_HAS(re->sets[in->x],c))
+            reClosure(re,d->pcs[j]+1,0,0,&n);
+    }
+    reClosure(re,0,0,0,&n);
+    next = reDStateFor(re,re->list,n);
+    re->dstates[from].next[c] = next;
+    return next;
+}
+
+/* Return 1 if the regex matches somewhere in the 'len' bytes at 's',
+ * otherwise 0. This runs the lazy DFA: no positions are reported. */
+int regexMatches(struct regex *re, const char *s, int len) {
+    int st = re->dstart;
+
+    /* The DFA states don't know if they are at the start of the row
+     * when it ends, that only matters for empty rows (think of "$^"). */
+    if (len == 0) {
+        int caps[RE_MAX_GROUPS*2];
+        return regexExec(re,s,len,0,caps);
+    }
+    if (st == -1) {
+        /* The start state was flushed from the cache. */
+        int n = 0;
+        re->gen++;
+        reClosure(re,0,1,0,&n);
+        st = re->dstart = reDStateFor(re,re->list,n);
+    }
+    if (re->dstates[st].match) return 1;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        int next = re->dstates[st].next[c];
+        st = next != -1 ? next : reDStep(re,st,c);
+        if (re->dstates[st].match) return 1;
+    }
+    return re->dstates[st].match_end;
+}
+
+/* Add a thread at 'pc' to the Pike VM list 'l', following the
+ * instructions that don't consume bytes. 'caps' are the thread captures,
+ * 'pos' the current position. */
+void reAddThread(struct regex *re, int l, int pc, int *caps, int pos,
+                 int len)
+{
+    if (re->mark[pc] == re->gen) return;
+    re->mark[pc] = re->gen;
+
+    struct reInst *in = re->prog+pc;
+    int ncaps = re->ngroups*2;
+    switch(in->op) {
+    case RI_JMP:
+        reAddThread(re,l,in->x,caps,pos,len);
+        break;
+    case RI_SPLIT:
+        reAddThread(re,l,in->x,caps,pos,len);
+        reAddThread(re,l,in->y,caps,pos,len);
+        break;
+    case RI_SAVE: {
+        int old = caps[in->x];
+        caps[in->x] = pos;
+        reAddThread(re,l,pc+1,caps,pos,len);
+        caps[in->x] = old;
+        break;
+    }
+    case RI_BOL:
+        if (pos == 0) reAddThread(re,l,pc+1,caps,pos,len);
+        break;
+    case RI_EOL:
+        if (pos == len) reAddThread(re,l,pc+1,caps,pos,len);
+        break;
+    default:
+        re->tpc[l][re->tlen[l]] = pc;
+        memcpy(re->tcaps[l]+re->tlen[l]*ncaps,caps,sizeof(int)*ncaps);
+        re->tlen[l]++;
+        break;
+    }
+}
+
+/* Find the leftmost match starting at 'from' or after in the 'len' bytes
+ * at 's', using the Pike VM. On success returns 1 and fills 'caps' with
+ * the start and end offsets of the match and of every group (-1 for the
+ * groups that did not participate), that is regexGroups()*2 integers.
+ * Otherwise 0 is returned. */
+int regexExec(struct regex *re, const char *s, int len, int from,
+              int *caps)
+{
+    int ncaps = re->ngroups*2, cur = 0, matched = 0, pos;
+    int start[RE_MAX_GROUPS*2];
+
+    for (int j = 0; j < ncaps; j++) start[j] = -1;
+    re->gen++;
+    re->tlen[cur] = 0;
+    reAddThread(re,cur,0,start,from,len);
+    for (pos = from; pos <= len; pos++) {
+        int nxt = !cur;
+        if (matched && re->tlen[cur] == 0) break;
+        re->gen++;
+        re->tlen[nxt] = 0;
+        for (int j = 0; j < re->tlen[cur]; j++) {
+            struct reInst *in = re->prog+re->tpc[cur][j];
+            int *tcaps = re->tcaps[cur]+j*ncaps;
+            if (in->op == RI_MATCH) {
+                /* Threads after this one have lower priority. */
+                memcpy(caps,tcaps,sizeof(int)*ncaps);
+                matched = 1;
+                break;
+            }
+            if (pos < len && RE_SET_HAS(re->sets[in->x],(unsigned char)s[pos]))
+                reAddThread(re,nxt,re->tpc[cur][j]+1,tcaps,pos+1,len);
         }
-        abAppend(&ab,"\x1b[39m",5);
-        abAppend(&ab,"\x1b[0K",4);
-        abAppend(&ab,"\r\n",2);
+        /* Until there is a match, one may start at the next position. */
+        if (!matched && pos < len) {
+            for (int j = 0; j < ncaps; j++) start[j] = -1;
+            reAddThread(re,nxt,0,start,pos+1,len);
+        }
+        cur = nxt;
     }
+    return matched;
+}
 
-    /* Create a two rows status. First row: */
-    abAppend(&ab,"\x1b[0K",4);
-    abAppend(&ab,"\x1b[7m",4);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-        E.filename, E.numrows, E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus),
-        "%d/%d",E.rowoff+E.cy+1,E.numrows);
-    if (len > E.screencols) len = E.screencols;
-    abAppend(&ab,status,len);
-    while(len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abAppend(&ab,rstatus,rlen);
-            break;
+/* Return the number of capture slot pairs regexExec() fills: one for the
+ * whole match, and one for every group. */
+int regexGroups(struct regex *re) {
+    return re->ngroups;
+}
+
+/* Compile the pattern 'pat' of length 'len'. With SEARCH_ICASE in 'flags'
+ * the case is ignored. Returns NULL on error, setting '*err' to a
+ * description of the problem. */
+struct regex *regexCompile(const char *pat, int len, int flags,
+                           const char **err)
+{
+    struct reParser ps;
+    struct regex *re;
+    int root;
+
+    memset(&ps,0,sizeof(ps));
+    ps.p = pat;
+    ps.end = pat+len;
+    ps.icase = flags & SEARCH_ICASE;
+    ps.ngroups = 1; /* Group 0 is the whole match. */
+    if (len >= 4 && !memcmp(pat,"(?i)",4)) {
+        ps.icase = 1;
+        ps.p += 4;
+    }
+    root = reParseAlt(&ps);
+    if (root != -1 && ps.p != ps.end) {
+        ps.err = "unmatched )";
+        root = -1;
+    }
+
+    re = calloc(1,sizeof(*re));
+    re->prog = malloc(sizeof(struct reInst)*RE_MAX_INST);
+    re->sets = ps.sets;
+    re->nsets = ps.nsets;
+    re->ngroups = ps.ngroups;
+    if (root != -1) {
+        /* save 0; the pattern; save 1; match */
+        if (reEmit(re,RI_SAVE,0,0) == -1 ||
+            reCompileNode(re,ps.nodes,root) == -1 ||
+            reEmit(re,RI_SAVE,1,0) == -1 ||
+            reEmit(re,RI_MATCH,0,0) == -1)
+        {
+            ps.err = "pattern too big";
+            root = -1;
+        }
+    }
+    free(ps.nodes);
+    if (root == -1) {
+        *err = ps.err;
+        regexFree(re);
+        return NULL;
+    }
+
+    re->list = malloc(sizeof(int)*re->len);
+    re->stack = malloc(sizeof(int)*(re->len*2+1));
+    re->mark = calloc(re->len,sizeof(int));
+    for (int j = 0; j < 2; j++) {
+        re->tpc[j] = malloc(sizeof(int)*re->len);
+        re->tcaps[j] = malloc(sizeof(int)*re->len*re->ngroups*2);
+    }
+    re->dstates = malloc(sizeof(struct reDState)*RE_DFA_MAX_STATES);
+    re->dhashsize = 2048;
+    re->dhash = malloc(sizeof(int)*re->dhashsize);
+    reDFAReset(re);
+    re->dstart = -1;
+    return re;
+}
+
+/* Store in 'offs' and 'lens' the offsets and lengths of the matches of the
+ * regex in the 'len' bytes at 's', up to 'max' of them. Like searchRow()
+ * it returns the number of matches stored. */
+int regexRow(struct regex *re, const char *s, int len, int *offs, int *lens,
+             int max)
+{
+    int caps[RE_MAX_GROUPS*2], n = 0, from = 0;
+
+    if (!regexMatches(re,s,len)) return 0;
+    while(n < max && from <= len && regexExec(re,s,len,from,caps)) {
+        offs[n] = caps[0];
+        lens[n] = caps[1]-caps[0];
+        n++;
+        /* Go on after the match, or after an empty match position. */
+        from = caps[1] > caps[0] ? caps[1] : caps[1]+1;
+    }
+    return n;
+}
+
+/* ============================= Parallel search ============================ */
+
+/* Whole buffer searches split the rows among worker threads, every one
+ * collecting the matches of a contiguous slice: joining the slices in
+ * order gives all the matches sorted by position, without sorting. */
+
+#define KILO_SEARCH_MAX_THREADS 8
+#define KILO_SEARCH_SLICE_ROWS 4096   /* Min rows worth a thread. */
+
+struct searchWorker {
+    pthread_t thread;
+    int *rows;              /* Rows to search, or NULL for all of them. */
+    int from, to;           /* Slice of 'rows' (or of the buffer) to search. */
+    struct searchQuery *q;  /* The query, unless SEARCH_REGEX. */
+    char *pat;              /* The regex, with SEARCH_REGEX. */
+    int patlen;
+    int flags;
+    int threaded;           /* Running in its own thread? */
+    int *cands;             /* If not NULL, store here the rows matching
+                               ignoring SEARCH_WORD. */
+    int ncands;
+    struct searchMatch *m;  /* Matches found. */
+    int len, cap;
+};
+
+void *searchWorkerRun(void *arg) {
+    struct searchWorker *w = arg;
+    struct regex *re = NULL;
+    const char *err;
+    int *offs = NULL, *lens = NULL, max = 0;
+
+    /* The DFA cache of a regex can't be shared: every worker has its
+     * own copy. */
+    if (w->flags & SEARCH_REGEX) {
+        re = regexCompile(w->pat,w->patlen,w->flags,&err);
+        if (re == NULL) return NULL;
+    }
+    for (int j = w->from; j < w->to; j++) {
+        int r = w->rows ? w->rows[j] : j, n;
+        erow *row = E.row+r;
+
+        /* There can't be more matches than bytes, plus an empty one. */
+        if (row->size+1 > max) {
+            max = row->size+1;
+            offs = realloc(offs,sizeof(int)*max);
+            lens = realloc(lens,sizeof(int)*max);
+        }
+        if (re) {
+            n = regexRow(re,row->chars,row->size,offs,lens,max);
         } else {
-            abAppend(&ab," ",1);
-            len++;
+            n = searchRow(w->q,row->chars,row->size,offs,max);
+            for (int k = 0; k < n; k++) lens[k] = w->q->len;
+        }
+        if (w->cands && (n || ((w->flags & SEARCH_WORD) &&
+            searchFind(w->q,row->chars,row->size,0) != -1)))
+        {
+            w->cands[w->ncands++] = r;
+        }
+        if (w->len+n > w->cap) {
+            w->cap = (w->len+n)*2;
+            w->m = realloc(w->m,sizeof(struct searchMatch)*w->cap);
+        }
+        for (int k = 0; k < n; k++) {
+            w->m[w->len].row = r;
+            w->m[w->len].off = offs[k];
+            w->m[w->len].len = lens[k];
+            w->len++;
         }
     }
-    abAppend(&ab,"\x1b[0m\r\n",6);
+    free(offs);
+    free(lens);
+    regexFree(re);
+    return NULL;
+}
 
-    /* Second row depends on E.statusmsg and the status message update time. */
-    abAppend(&ab,"\x1b[0K",4);
-    int msglen = strlen(E.statusmsg);
-    if (msglen && time(NULL)-E.statusmsg_time < 5)
-        abAppend(&ab,E.statusmsg,msglen <= E.screencols ? msglen : E.screencols);
+/* Search the 'nrows' rows listed in 'rows' (or the first 'nrows' rows if
+ * NULL) for the query 'q', or for the regex 'pat' of length 'patlen' with
+ * SEARCH_REGEX in 'flags', and store all the matches in 'idx'. If 'cands'
+ * is not NULL the rows matching ignoring SEARCH_WORD are appended to it:
+ * it must have room for 'nrows' more rows. */
+void searchScan(int *rows, int nrows, struct searchQuery *q, char *pat,
+                int patlen, int flags, struct searchCands *cands,
+                struct searchIndex *idx)
+{
+    struct searchWorker w[KILO_SEARCH_MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = nrows/KILO_SEARCH_SLICE_ROWS, j, len = 0;
+
+    if (cpus > KILO_SEARCH_MAX_THREADS) cpus = KILO_SEARCH_MAX_THREADS;
+    if (nthreads > cpus) nthreads = cpus;
+    if (nthreads < 1) nthreads = 1;
+
+    for (j = 0; j < nthreads; j++) {
+        memset(w+j,0,sizeof(w[j]));
+        w[j].rows = rows;
+        w[j].from = (long long)nrows*j/nthreads;
+        w[j].to = (long long)nrows*(j+1)/nthreads;
+        w[j].q = q;
+        w[j].pat = pat;
+        w[j].patlen = patlen;
+        w[j].flags = flags;
+        /* Every worker gets its own part of the candidates array. */
+        if (cands) w[j].cands = cands->rows+cands->len+w[j].from;
+    }
+    /* The first slice is searched by this thread. */
+    for (j = 1; j < nthreads; j++) {
+        if (pthread_create(&w[j].thread,NULL,searchWorkerRun,w+j) == 0)
+            w[j].threaded = 1;
+        else
+            searchWorkerRun(w+j);
+    }
+    searchWorkerRun(w);
 
-    /* Put cursor at its current position. Note that the horizontal position
-     * at which the cursor is displayed may be different compared to 'E.cx'
-     * because of TABs. */
-    int j;
-    int cx = 1;
-    int filerow = E.rowoff+E.cy;
-    erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
-    if (row) {
-        for (j = E.coloff; j < (E.cx+E.coloff); j++) {
-            if (j < row->size && row->chars[j] == TAB) cx += 7-((cx)%8);
-            cx++;
+    free(idx->m);
+    for (j = 0; j < nthreads; j++) {
+        if (w[j].threaded) pthread_join(w[j].thread,NULL);
+        len += w[j].len;
+    }
+    idx->m = malloc(sizeof(struct searchMatch)*(len ? len : 1));
+    idx->len = 0;
+    idx->version = E.version;
+    for (j = 0; j < nthreads; j++) {
+        memcpy(idx->m+idx->len,w[j].m,sizeof(struct searchMatch)*w[j].len);
+        idx->len += w[j].len;
+        free(w[j].m);
+        if (cands) {
+            memmove(cands->rows+cands->len,w[j].cands,
+                    sizeof(int)*w[j].ncands);
+            cands->len += w[j].ncands;
         }
     }
-    snprintf(buf,sizeof(buf),"\x1b[%d;%dH",E.cy+1,cx);
-    abAppend(&ab,buf,strlen(buf));
-    abAppend(&ab,"\x1b[?25h",6); /* Show cursor. */
-    write(STDOUT_FILENO,ab.b,ab.len);
-    abFree(&ab);
 }
 
-/* Set an editor status message for the second line of the status, at the
- * end of the screen. */
-void editorSetStatusMessage(const char *fmt, ...) {
-    va_list ap;
-    va_start(ap,fmt);
-    vsnprintf(E.statusmsg,sizeof(E.statusmsg),fmt,ap);
-    va_end(ap);
-    E.statusmsg_time = time(NULL);
+/* Return the index of the first match in 'idx' at or after the offset
+ * 'off' of the row 'row', or idx->len if there is none. */
+int searchIndexSeek(struct searchIndex *idx, int row, int off) {
+    int lo = 0, hi = idx->len;
+
+    while(lo < hi) {
+        int mid = (lo+hi)/2;
+        struct searchMatch *m = idx->m+mid;
+        if (m->row < row || (m->row == row && m->off < off)) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
 }
 
-/* =============================== Find mode ================================ */
+/* Find all the occurrences of the string 'query' of length 'qlen' in the
+ * buffer, using the trigram index if possible. Returns a heap allocated
+ * array with the row, offset and length of every match, storing the number
+ * of matches in '*count', or NULL if the query is longer than
+ * KILO_QUERY_LEN. */
+int *editorFindAll(char *query, int qlen, int *count) {
+    struct searchQuery q;
+    struct searchIndex idx = {NULL,0,0};
+    int *rows = NULL, n;
+    int *res;
+
+    *count = 0;
+    if (qlen > KILO_QUERY_LEN) return NULL;
+    n = editorTrigramCandidates(query,qlen,&rows);
+    searchCompile(&q,query,qlen,0);
+    if (qlen) searchScan(rows,n == -1 ? E.numrows : n,&q,NULL,0,0,NULL,&idx);
+    free(rows);
+    res = malloc(sizeof(int)*3*(idx.len ? idx.len : 1));
+    for (int j = 0; j < idx.len; j++) {
+        res[j*3] = idx.m[j].row;
+        res[j*3+1] = idx.m[j].off;
+        res[j*3+2] = idx.m[j].len;
+    }
+    *count = idx.len;
+    free(idx.m);
+    return res;
+}
 
-#define KILO_QUERY_LEN 256
+/* Called by editorRefreshScreen() for the row 'filerow', whose 'len'
+ * rendered chars from E.coloff are being drawn: if the row has matches of
+ * the find query, return a copy of the highlight 'hl' of those chars with
+ * the matches on top, otherwise NULL. The caller frees the copy. */
+unsigned char *editorFindOverlay(int filerow, unsigned char *hl, int len) {
+    struct searchIndex *idx = E.find;
+    int j = searchIndexSeek(idx,filerow,0);
+    unsigned char *overlay = NULL;
+    erow *row = E.row+filerow;
+
+    for (; j < idx->len && idx->m[j].row == filerow; j++) {
+        int start = editorRowCxToRx(row,idx->m[j].off)-E.coloff;
+        int end = editorRowCxToRx(row,idx->m[j].off+idx->m[j].len)-E.coloff;
+        if (start < 0) start = 0;
+        if (end > len) end = len;
+        if (start >= end) continue;
+        if (overlay == NULL) {
+            overlay = malloc(len);
+            memcpy(overlay,hl,len);
+        }
+        memset(overlay+start,HL_MATCH,end-start);
+    }
+    return overlay;
+}
+
+/* =============================== Find mode ================================ */
 
 void editorFind(int fd) {
     char query[KILO_QUERY_LEN+1] = {0};
     int qlen = 0;
-    int last_match = -1; /* Last line where a match was found. -1 for none. */
-    int find_next = 0; /* if 1 search next, if -1 search prev. */
-    int saved_hl_line = -1;  /* No saved HL */
-    char *saved_hl = NULL;
-
-#define FIND_RESTORE_HL do { \
-    if (saved_hl) { \
-        memcpy(E.row[saved_hl_line].hl,saved_hl, E.row[saved_hl_line].rsize); \
-        free(saved_hl); \
-        saved_hl = NULL; \
-    } \
-} while (0)
+    int cur = -1;       /* Current match in the index. -1 for none. */
+    int cur_row = 0, cur_off = 0;   /* Position of the current match. */
+    int find_next = 0;  /* if 1 search next, if -1 search prev. */
+    int changed = 1;    /* Query or flags changed since the last search. */
+    int flags = 0; /* SEARCH_* flags, toggled with TAB, CTRL-W, CTRL-R. */
+    struct searchNarrowing sn;
+    struct searchIndex idx;
+    const char *re_err = NULL;
+
+    sn.depth = 0;
+    sn.version = E.version;
+    sn.icase = 0;
+    idx.m = NULL;
+    idx.len = 0;
+    idx.version = E.version;
+    E.find = &idx;
 
     /* Save the cursor position in order to restore it later. */
     int saved_cx = E.cx, saved_cy = E.cy;
@@ -1520,21 +6067,39 @@ void editorFind(int fd) {
 
     while(1) {
         editorSetStatusMessage(
-            "Search: %s (Use ESC/Arrows/Enter)", query);
+            "Search: %s [%d/%d]%s%s%s%s%s%s (ESC/Arrows/Enter, Tab: case, "
+            "^W: word, ^R: regex)", query, cur+1, idx.len,
+            (flags & SEARCH_ICASE) ? " [icase]" : "",
+            (flags & SEARCH_WORD) ? " [word]" : "",
+            (flags & SEARCH_REGEX) ? " [regex" : "",
+            (flags & SEARCH_REGEX) && re_err ? ": " : "",
+            (flags & SEARCH_REGEX) && re_err ? re_err : "",
+            (flags & SEARCH_REGEX) ? "]" : "");
         editorRefreshScreen();
 
         int c = editorReadKey(fd);
         if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE) {
             if (qlen != 0) query[--qlen] = '\0';
-            last_match = -1;
+            changed = 1;
         } else if (c == ESC || c == ENTER) {
             if (c == ESC) {
                 E.cx = saved_cx; E.cy = saved_cy;
                 E.coloff = saved_coloff; E.rowoff = saved_rowoff;
             }
-            FIND_RESTORE_HL;
+            E.find = NULL;
+            free(idx.m);
+            searchNarrowingPop(&sn,sn.depth);
             editorSetStatusMessage("");
             return;
+        } else if (c == TAB) {
+            flags ^= SEARCH_ICASE;
+            changed = 1;
+        } else if (c == CTRL_W) {
+            flags ^= SEARCH_WORD;
+            changed = 1;
+        } else if (c == CTRL_R) {
+            flags ^= SEARCH_REGEX;
+            changed = 1;
         } else if (c == ARROW_RIGHT || c == ARROW_DOWN) {
             find_next = 1;
         } else if (c == ARROW_LEFT || c == ARROW_UP) {
@@ -1543,63 +6108,279 @@ void editorFind(int fd) {
             if (qlen < KILO_QUERY_LEN) {
                 query[qlen++] = c;
                 query[qlen] = '\0';
-                last_match = -1;
+                changed = 1;
             }
         }
 
-        /* Search occurrence. */
-        if (last_match == -1) find_next = 1;
-        if (find_next) {
-            char *match = NULL;
-            int match_offset = 0;
-            int i, current = last_match;
-
-            for (i = 0; i < E.numrows; i++) {
-                current += find_next;
-                if (current == -1) current = E.numrows-1;
-                else if (current == E.numrows) current = 0;
-                match = strstr(E.row[current].render,query);
-                if (match) {
-                    match_offset = match-E.row[current].render;
-                    break;
+        /* Collect all the matches again if the query or the rows
+         * changed, then go to the first one at the current match or
+         * after it. */
+        if (changed || idx.version != E.version) {
+            re_err = NULL;
+            idx.len = 0;
+            idx.version = E.version;
+            if (qlen && (flags & SEARCH_REGEX)) {
+                /* Regex matches can't be narrowed down as the query
+                 * grows: every row is searched. */
+                struct regex *re = regexCompile(query,qlen,flags,&re_err);
+                if (re) {
+                    regexFree(re);
+                    searchScan(NULL,E.numrows,NULL,query,qlen,flags,NULL,
+                               &idx);
                 }
+            } else if (qlen) {
+                searchNarrow(&sn,query,qlen,flags,&idx);
             }
+            cur = searchIndexSeek(&idx,cur_row,cur_off);
+            if (cur == idx.len) cur = idx.len ? 0 : -1;
+            changed = 0;
             find_next = 0;
+        } else if (find_next && idx.len) {
+            /* Go to the next or previous match. */
+            cur = (cur+find_next+idx.len) % idx.len;
+            find_next = 0;
+        } else {
+            continue;
+        }
 
-            /* Highlight */
-            FIND_RESTORE_HL;
-
-            if (match) {
-                erow *row = &E.row[current];
-                last_match = current;
-                if (row->hl) {
-                    saved_hl_line = current;
-                    saved_hl = malloc(row->rsize);
-                    memcpy(saved_hl,row->hl,row->rsize);
-                    memset(row->hl+match_offset,HL_MATCH,qlen);
-                }
-                E.cy = 0;
-                E.cx = match_offset;
-                E.rowoff = current;
-                E.coloff = 0;
-                /* Scroll horizontally as needed. */
-                if (E.cx > E.screencols) {
-                    int diff = E.cx - E.screencols;
-                    E.cx -= diff;
-                    E.coloff += diff;
-                }
+        if (cur != -1) {
+            struct searchMatch *m = idx.m+cur;
+            cur_row = m->row;
+            cur_off = m->off;
+            E.cy = 0;
+            E.cx = m->off;
+            E.rowoff = m->row;
+            E.coloff = 0;
+            /* Scroll horizontally as needed. */
+            if (E.cx > E.screencols) {
+                int diff = E.cx - E.screencols;
+                E.cx -= diff;
+                E.coloff += diff;
             }
         }
     }
 }
 
+/* ================================= Replace ================================ */
+
+/* Append the replacement 'repl' of length 'rlen' to 'ab'. With a regex
+ * match, whose groups are in 'caps', \0 to \9 stand for the groups of the
+ * match in 's', and \\ for a backslash. */
+void editorReplaceExpand(struct abuf *ab, char *repl, int rlen, char *s,
+                         int *caps, int ngroups)
+{
+    for (int j = 0; j < rlen; j++) {
+        if (caps && repl[j] == '\\' && j+1 < rlen) {
+            int c = repl[j+1];
+            if (isdigit(c) && c-'0' < ngroups) {
+                int g = c-'0';
+                if (caps[g*2] != -1)
+                    abAppend(ab,s+caps[g*2],caps[g*2+1]-caps[g*2]);
+                j++;
+                continue;
+            } else if (c == '\\') {
+                j++;
+            }
+        }
+        abAppend(ab,repl+j,1);
+    }
+}
+
+/* Replace all the matches of 'query' of length 'qlen' (with the SEARCH_*
+ * 'flags' of find mode) with 'repl', of length 'rlen', in a single pass:
+ * the matches are collected, then every row having some is rebuilt and
+ * highlighted once. The old rows go in a single undo record. Returns the
+ * number of replacements, storing the number of rows changed in '*rows',
+ * or -1 if the query is not a valid regex or is longer than KILO_QUERY_LEN,
+ * setting '*err'. */
+int editorReplaceAll(char *query, int qlen, int flags, char *repl, int rlen,
+                     int *rows, const char **err)
+{
+    struct searchIndex idx = {NULL,0,0};
+    struct regex *re = NULL;
+    int caps[RE_MAX_GROUPS*2], j = 0;
+
+    *rows = 0;
+    if (qlen == 0) return 0;
+    if (flags & SEARCH_REGEX) {
+        if ((re = regexCompile(query,qlen,flags,err)) == NULL) return -1;
+        searchScan(NULL,E.numrows,NULL,query,qlen,flags,NULL,&idx);
+    } else {
+        struct searchQuery q;
+        if (qlen > KILO_QUERY_LEN) {
+            *err = "query too long";
+            return -1;
+        }
+        int *cands = NULL, n = editorTrigramCandidates(query,qlen,&cands);
+        searchCompile(&q,query,qlen,flags);
+        searchScan(cands,n == -1 ? E.numrows : n,&q,NULL,0,flags,NULL,&idx);
+        free(cands);
+    }
+
+    struct undoRecord *u = editorUndoBegin();
+    while(j < idx.len) {
+        struct abuf ab = ABUF_INIT;
+        int r = idx.m[j].row, prev = 0;
+        erow *row = E.row+r;
+
+        for (; j < idx.len && idx.m[j].row == r; j++) {
+            struct searchMatch *m = idx.m+j;
+            abAppend(&ab,row->chars+prev,m->off-prev);
+            /* The groups are found running the regex again from the
+             * match, that is found again. */
+            if (re && regexExec(re,row->chars,row->size,m->off,caps))
+                editorReplaceExpand(&ab,repl,rlen,row->chars,caps,
+                                    regexGroups(re));
+            else
+                editorReplaceExpand(&ab,repl,rlen,row->chars,NULL,0);
+            prev = m->off+m->len;
+        }
+        abAppend(&ab,row->chars+prev,row->size-prev);
+        abAppend(&ab,"",1); /* Null term. */
+
+        editorRowChanging(row);
+        editorUndoSaveRow(u,r,row->chars,row->size);
+        row->chars = ab.b;
+        row->size = ab.len-1;
+        editorUpdateRow(row);
+        (*rows)++;
+    }
+    editorUndoEnd(u);
+    regexFree(re);
+    if (*rows) E.dirty++;
+    editorClampCursor();
+    free(idx.m);
+    return idx.len;
+}
+
+/* Let the user type a string in the status bar after 'prompt', storing it
+ * in 'buf' of 'size' bytes. If 'flags' is not NULL TAB, CTRL-W and CTRL-R
+ * toggle the SEARCH_* flags there, like in find mode. Returns the length
+ * of the string, or -1 if the user pressed ESC. */
+int editorPrompt(int fd, char *prompt, char *buf, int size, int *flags) {
+    int len = 0;
+
+    buf[0] = '\0';
+    while(1) {
+        if (flags)
+            editorSetStatusMessage("%s: %s%s%s%s (ESC/Enter, Tab: case, "
+                "^W: word, ^R: regex)", prompt, buf,
+                (*flags & SEARCH_ICASE) ? " [icase]" : "",
+                (*flags & SEARCH_WORD) ? " [word]" : "",
+                (*flags & SEARCH_REGEX) ? " [regex]" : "");
+        else
+            editorSetStatusMessage("%s: %s (ESC/Enter)", prompt, buf);
+        editorRefreshScreen();
+
+        int c = editorReadKey(fd);
+        if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE) {
+            if (len != 0) buf[--len] = '\0';
+        } else if (c == ESC) {
+            editorSetStatusMessage("");
+            return -1;
+        } else if (c == ENTER) {
+            editorSetStatusMessage("");
+            return len;
+        } else if (flags && c == TAB) {
+            *flags ^= SEARCH_ICASE;
+        } else if (flags && c == CTRL_W) {
+            *flags ^= SEARCH_WORD;
+        } else if (flags && c == CTRL_R) {
+            *flags ^= SEARCH_REGEX;
+        } else if (isprint(c) && len < size-1) {
+            buf[len++] = c;
+            buf[len] = '\0';
+        }
+    }
+}
+
+/* Ask for a query and a replacement, and replace all the matches. */
+void editorReplace(int fd) {
+    char query[KILO_QUERY_LEN+1], repl[KILO_QUERY_LEN+1];
+    int flags = 0, qlen, rlen, rows;
+    const char *err = NULL;
+
+    qlen = editorPrompt(fd,"Replace",query,sizeof(query),&flags);
+    if (qlen <= 0) return;
+    rlen = editorPrompt(fd,(flags & SEARCH_REGEX) ?
+        "With (\\0-\\9 for the groups)" : "With",repl,sizeof(repl),NULL);
+    if (rlen == -1) return;
+
+    int n = editorReplaceAll(query,qlen,flags,repl,rlen,&rows,&err);
+    if (n == -1)
+        editorSetStatusMessage("Invalid regex: %s", err);
+    else
+        editorSetStatusMessage("Replaced %d occurrences in %d rows%s", n,
+            rows, rows ? " (Ctrl-Z to undo)" : "");
+}
+
+/* ============================= Keyboard macros ============================ */
+
+/* Append a processed key to the macro being recorded. Interactive keys
+ * that would block a replay waiting for input (find) or quit the editor
+ * are not recorded. */
+void editorMacroRecordKey(int c) {
+    struct editorMacro *m = &E.macro;
+
+    if (!m->recording || m->playing) return;
+    if (c == CTRL_F || c == CTRL_R || c == CTRL_Q) return;
+    if (m->len == m->cap) {
+        int newcap = m->cap ? m->cap*2 : 64;
+        uint16_t *newkeys = realloc(m->keys,sizeof(uint16_t)*newcap);
+        if (newkeys == NULL) return;
+        m->keys = newkeys;
+        m->cap = newcap;
+    }
+    m->keys[m->len++] = (uint16_t)c;
+}
+
+/* Start recording a new macro, or stop the recording in progress. */
+void editorMacroToggleRecording(void) {
+    struct editorMacro *m = &E.macro;
+
+    if (m->playing) return;
+    if (m->recording) {
+        m->recording = 0;
+        editorSetStatusMessage("Macro recorded: %d keys", m->len);
+    } else {
+        m->len = 0;
+        m->recording = 1;
+        editorSetStatusMessage("Recording macro...");
+    }
+}
+
+void editorProcessKeypress(int c, int trigger_cb);
+
+/* Replay the recorded macro 'times' times. Keys go straight to the default
+ * key handling: on-key callbacks are not triggered and the screen is not
+ * refreshed (not even by the timeout handler thread) until the whole
+ * replay is done, then it is rendered once. */
+void editorMacroPlay(int times) {
+    struct editorMacro *m = &E.macro;
+
+    if (m->playing) return;
+    if (m->recording) {
+        editorSetStatusMessage("Can't replay a macro while recording it");
+        return;
+    }
+
+    m->playing = 1;
+    E.norefresh++;
+    while(times-- > 0) {
+        for (int j = 0; j < m->len; j++)
+            editorProcessKeypress(m->keys[j], 0);
+    }
+    E.norefresh--;
+    m->playing = 0;
+    editorRefreshScreen();
+}
+
 /* ========================= Editor events handling  ======================== */
 
 /* Handle cursor position change because arrow keys were pressed. */
 void editorMoveCursor(int key) {
     int filerow = E.rowoff+E.cy;
     int filecol = E.coloff+E.cx;
-    int rowlen;
     erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
 
     switch(key) {
@@ -1656,17 +6437,7 @@ void editorMoveCursor(int key) {
         break;
     }
     /* Fix cx if the current line has not enough chars. */
-    filerow = E.rowoff+E.cy;
-    filecol = E.coloff+E.cx;
-    row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
-    rowlen = row ? row->size : 0;
-    if (filecol > rowlen) {
-        E.cx -= filecol-rowlen;
-        if (E.cx < 0) {
-            E.coloff += E.cx;
-            E.cx = 0;
-        }
-    }
+    editorClampCursor();
 }
 
 /* Process events arriving from the standard input, which is, the user
@@ -1678,6 +6449,11 @@ void editorProcessKeypress(int c, int trigger_cb) {
     static int quit_times = KILO_QUIT_TIMES;
 
 #ifdef PLUGINS_ENABLED
+    /* During a macro replay callbacks are suppressed, so nobody can look
+     * at kilo_pressed_key: skip the plugins machinery entirely. */
+    if (E.macro.playing)
+        goto default_exec;
+
     ForthObject *k = ForthObject__new_number((double)c);
     ForthInterpreter__register_object(F, "kilo_pressed_key", k);
     ForthObject__drop(k);
@@ -1685,10 +6461,16 @@ void editorProcessKeypress(int c, int trigger_cb) {
     if (!trigger_cb)
       goto default_exec;
 
-    ForthObject *cb_obj = editorGetOnKeyCallback(c);
+    editorLazyKey(c);
+
+    int plugin;
+    ForthObject *cb_obj = editorGetOnKeyCallback(c, &plugin);
     if (cb_obj) {
-        ForthEvalResult res = ForthInterpreter__eval_every(F, cb_obj);;
-        
+        // its plugin may be reloaded meanwhile, if it opens a prompt
+        cb_obj = ForthObject__rc_clone(cb_obj);
+        ForthEvalResult res = editorRunCallback(cb_obj, PROF_KEY, c, plugin);
+        ForthObject__drop(cb_obj);
+
         if (res != Ok)
             fprintf(stderr, "Warn: nonzero result in callback\n");
 
@@ -1697,6 +6479,7 @@ void editorProcessKeypress(int c, int trigger_cb) {
 #endif
 
 default_exec:
+    editorMacroRecordKey(c);
 
     switch(c) {
     case ENTER:         /* Enter */
@@ -1720,7 +6503,19 @@ default_exec:
         editorSave();
         break;
     case CTRL_F:
-        editorFind(STDIN_FILENO);
+        /* Find mode is interactive, there is no terminal in batch mode. */
+        if (!E.batch) editorFind(STDIN_FILENO);
+        break;
+    case CTRL_R:
+        if (!E.batch) editorReplace(STDIN_FILENO);
+        break;
+    case CTRL_Z:
+        editorUndo();
+        break;
+    case CTRL_P:
+#ifdef PLUGINS_ENABLED
+        editorProfileOverlay();
+#endif
         break;
     case BACKSPACE:     /* Backspace */
     case CTRL_H:        /* Ctrl-h */
@@ -1787,25 +6582,334 @@ void initEditor(void) {
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
+    E.hl_stale = -1;
     E.row = NULL;
     E.dirty = 0;
     E.filename = NULL;
     E.syntax = NULL;
+    editorInitCharClasses();
+    if (E.batch) {
+        /* No terminal to query: pretend a standard 80x24 one, so that
+         * cursor movements and scrolling behave as usual. */
+        E.screenrows = 24-2;
+        E.screencols = 80;
+        E.norefresh = 1;
+        return;
+    }
     updateWindowSize();
     signal(SIGWINCH, handleSigWinCh);
 }
 
+/* Batch mode: run the Forth 'script' and/or replay the keystrokes stored in
+ * the 'keys' file (raw bytes, as typed on a terminal, escape sequences
+ * included) against the loaded file, then save it. There is no terminal
+ * I/O, so this works in pipelines, and since the timings are reported it
+ * can be used to benchmark editing throughput. Returns the exit code. */
+int editorBatch(char *script, char *keys) {
+    int retval = 0;
+
+#ifdef PLUGINS_ENABLED
+    if (script) {
+        uint64_t start = ustime();
+        ForthEvalError *errors = ForthInterpreter__run_file(F,script);
+        for (size_t i = 0; errors[i].result != Ok; i++) {
+            fprintf(stderr,"Error: %d at offset %d in '%s'\n",
+                errors[i].result, (int)errors[i].offset, script);
+            retval = 1;
+        }
+        free(errors);
+        editorJobsWait();
+        fprintf(stderr,"Info: batch script '%s' executed in %.3f ms\n",
+            script, (ustime()-start)/1000.0);
+    }
+#else
+    if (script) {
+        fprintf(stderr,"Error: this kilo was built without plugins support, "
+                       "can't run '%s'\n", script);
+        return 1;
+    }
+#endif
+
+    if (keys) {
+        FILE *fp = fopen(keys,"r");
+        if (!fp) {
+            perror("Opening keys file");
+            return 1;
+        }
+        struct keyBuffer kb = {NULL,0,0};
+        char chunk[4096];
+        size_t nread;
+        while((nread = fread(chunk,1,sizeof(chunk),fp)) > 0) {
+            char *newbuf = realloc((char*)kb.buf,kb.len+nread);
+            if (newbuf == NULL) break;
+            memcpy(newbuf+kb.len,chunk,nread);
+            kb.buf = newbuf;
+            kb.len += nread;
+        }
+        fclose(fp);
+
+        uint64_t start = ustime();
+        int numkeys = 0;
+        char c;
+        while(bufReadByte(&kb,&c)) {
+            editorProcessKeypress(editorDecodeKey(bufReadByte,&kb,c),1);
+            numkeys++;
+        }
+        uint64_t elapsed = ustime()-start;
+        fprintf(stderr,"Info: batch replayed %d keys in %.3f ms "
+                       "(%.0f keys/s)\n", numkeys, elapsed/1000.0,
+                       elapsed ? numkeys*1e6/elapsed : 0);
+        free((char*)kb.buf);
+    }
+#ifdef PLUGINS_ENABLED
+    editorJobsWait();
+#endif
+
+    if (editorSave()) retval = 1;
+    return retval;
+}
+
+/* =============================== Benchmarks =============================== */
+
+/* Highlight the whole file again and again, for about a second, and report
+ * the throughput. */
+int editorBenchHighlight(void) {
+    long long bytes = 0;
+    int passes = 0;
+    uint64_t start = ustime(), elapsed;
+
+    if (E.syntax == NULL) {
+        fprintf(stderr,"No syntax highlight for '%s'\n", E.filename);
+        return 1;
+    }
+    do {
+        for (int j = 0; j < E.numrows; j++) {
+            editorUpdateSyntax(E.row+j);
+            bytes += E.row[j].rsize;
+        }
+        passes++;
+        elapsed = ustime()-start;
+    } while(elapsed < 1000000);
+    printf("highlight: %d passes, %.2f MB in %.3f ms, %.2f MB/s\n",
+        passes, bytes/1e6, elapsed/1000.0, bytes/(double)elapsed);
+    return 0;
+}
+
+/* Run the query 'q', or the regex 're', (or strstr() over the rendered
+ * rows, the way editorFind() used to search, if both are NULL) against the
+ * first 'rows' rows for about 100 milliseconds. Returns the throughput in
+ * MB/s, and the number of matches of a pass in '*matches'. */
+double editorBenchSearchRun(struct searchQuery *q, struct regex *re,
+                            char *pat, int rows, int *matches)
+{
+    long long bytes = 0;
+    int offs[64], lens[64], patlen = strlen(pat);
+    uint64_t start = ustime(), elapsed;
+
+    do {
+        *matches = 0;
+        for (int j = 0; j < rows; j++) {
+            erow *row = E.row+j;
+            if (re) {
+                *matches += regexRow(re,row->chars,row->size,offs,lens,64);
+                bytes += row->size;
+            } else if (q) {
+                *matches += searchRow(q,row->chars,row->size,offs,64);
+                bytes += row->size;
+            } else {
+                char *p = row->render;
+                while((p = strstr(p,pat)) != NULL) {
+                    (*matches)++;
+                    p += patlen;
+                }
+                bytes += row->rsize;
+            }
+        }
+        elapsed = ustime()-start;
+    } while(elapsed < 100000);
+    return bytes/(double)elapsed;
+}
+
+/* Search a few patterns in growing portions of the file, and report the
+ * throughput of the search engine and of strstr(). */
+int editorBenchSearch(void) {
+    struct {
+        char *pat;
+        int flags;
+    } queries[] = {
+        {"e",0},
+        {"if",0},
+        {"return",0},
+        {"editorRefreshScreen",0},
+        {"this pattern is not in the file, probably",0},
+        {"ReTuRn",SEARCH_ICASE},
+        {"row",SEARCH_WORD},
+        {"return",SEARCH_REGEX},
+        {"editor[A-Z]\\w+\\(",SEARCH_REGEX},
+        {"^\\s*(if|while) ?\\(.*\\) \\{$",SEARCH_REGEX},
+        {"(x+x+)+y",SEARCH_REGEX}
+    };
+    struct searchQuery q;
+    struct regex *re;
+    const char *err;
+
+    for (unsigned int j = 0; j < sizeof(queries)/sizeof(queries[0]); j++) {
+        int flags = queries[j].flags;
+        searchCompile(&q,queries[j].pat,strlen(queries[j].pat),flags);
+        re = (flags & SEARCH_REGEX) ?
+            regexCompile(queries[j].pat,strlen(queries[j].pat),flags,&err) :
+            NULL;
+        for (int div = 64; div >= 1; div /= 4) {
+            int rows = E.numrows/div, matches, strstr_matches;
+            if (rows == 0) continue;
+            double mbs = editorBenchSearchRun(&q,re,queries[j].pat,rows,
+                                              &matches);
+            printf("search: %-24.24s %s%s%s %8d rows, %6d matches, "
+                   "%8.2f MB/s",
+                queries[j].pat,
+                (flags & SEARCH_ICASE) ? "i" : "-",
+                (flags & SEARCH_WORD) ? "w" : "-",
+                (flags & SEARCH_REGEX) ? "r" : "-",
+                rows, matches, mbs);
+            if (flags == 0) {
+                double base = editorBenchSearchRun(NULL,NULL,queries[j].pat,
+                                                   rows,&strstr_matches);
+                printf(", strstr %8.2f MB/s", base);
+            }
+            printf("\n");
+        }
+        regexFree(re);
+    }
+    return 0;
+}
+
+/* Run editorFindAll() for 'query' for about 100 milliseconds. Returns the
+ * milliseconds per call, and the number of matches in '*matches'. */
+double editorBenchFindRun(char *query, int *matches) {
+    uint64_t start = ustime(), elapsed;
+    int calls = 0;
+
+    do {
+        free(editorFindAll(query,strlen(query),matches));
+        calls++;
+        elapsed = ustime()-start;
+    } while(elapsed < 100000);
+    return elapsed/1000.0/calls;
+}
+
+/* Build the trigram index of the file, report its size and build time, and
+ * compare finding a few queries with and without it. */
+int editorBenchTrigrams(void) {
+    char *queries[] = {
+        "e",
+        "return",
+        "editorRefreshScreen",
+        "this pattern is not in the file, probably"
+    };
+    struct triIndex *idx = triNew();
+    uint64_t start = ustime();
+    int n;
+    struct triSortRow *order = triRowsSince(0,&n);
+
+    for (int j = 0; j < n; j++) {
+        erow *row = E.row+order[j].row;
+        triAddRow(idx,row->uid,row->chars,row->size);
+    }
+    free(order);
+    printf("trigrams: %d rows, %u trigrams, %zu postings, %.2f MB, "
+           "built in %.3f ms\n",
+        E.numrows, idx->used, idx->postings,
+        triMemory(idx)/(1024.0*1024), (ustime()-start)/1000.0);
+
+    for (unsigned int j = 0; j < sizeof(queries)/sizeof(queries[0]); j++) {
+        int matches, scan_matches, *rows = NULL;
+        E.tri = NULL;
+        double scan = editorBenchFindRun(queries[j],&scan_matches);
+        E.tri = idx;
+        double indexed = editorBenchFindRun(queries[j],&matches);
+        int cands = editorTrigramCandidates(queries[j],strlen(queries[j]),
+                                            &rows);
+        free(rows);
+        printf("trigrams: %-24.24s %8d candidate rows, %6d matches, "
+               "scan %8.3f ms, indexed %8.3f ms%s\n",
+            queries[j], cands == -1 ? E.numrows : cands, matches, scan,
+            indexed, matches != scan_matches ? " MISMATCH" : "");
+    }
+    E.tri = NULL;
+    triFree(idx);
+    return 0;
+}
+
+/* Run the benchmark called 'name' against the loaded file. */
+int editorBenchmark(char *name) {
+    if (!strcmp(name,"highlight")) return editorBenchHighlight();
+    if (!strcmp(name,"search")) return editorBenchSearch();
+    if (!strcmp(name,"trigrams")) return editorBenchTrigrams();
+    fprintf(stderr,"Unknown benchmark '%s'\n", name);
+    return 1;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr,"Usage: kilo <filename>\n");
+    char *filename = NULL, *script = NULL, *keys = NULL, *bench = NULL;
+
+    for (int j = 1; j < argc; j++) {
+        int lastarg = j == argc-1;
+        if (!strcmp(argv[j],"--batch") && !lastarg) {
+            script = argv[++j];
+            E.batch = 1;
+        } else if (!strcmp(argv[j],"--keys") && !lastarg) {
+            keys = argv[++j];
+            E.batch = 1;
+        } else if (!strcmp(argv[j],"--bench") && !lastarg) {
+            bench = argv[++j];
+            E.batch = 1;
+        } else if (filename == NULL && argv[j][0] != '-') {
+            filename = argv[j];
+        } else {
+            filename = NULL;
+            break;
+        }
+    }
+    if (filename == NULL) {
+        fprintf(stderr,"Usage: kilo <filename>\n"
+                       "       kilo --batch <script.forth> [--keys <file>] "
+                       "<filename>\n"
+                       "       kilo --bench highlight|search|trigrams <filename>\n");
         exit(1);
     }
     initEditor();
+
+    /* Read the file while the plugins are evaluated: they can't see the
+     * rows yet anyway, they are only created once both are done. */
+    uint64_t start = ustime();
+    struct fileLoad fl;
+    pthread_t loader;
+    memset(&fl,0,sizeof(fl));
+    fl.filename = filename;
+    int threaded = pthread_create(&loader,NULL,editorLoadFileThread,&fl) == 0;
+    if (!threaded) editorLoadFile(&fl);
 #ifdef PLUGINS_ENABLED
     initInterpreter();
 #endif
-    editorSelectSyntaxHighlight(argv[1]);
-    editorOpen(argv[1]);
+    uint64_t plugins_us = ustime()-start;
+    if (threaded) pthread_join(loader,NULL);
+    editorTrace("file read in %.3f ms, plugins initialized in %.3f ms, "
+                "both done after %.3f ms", fl.us/1000.0, plugins_us/1000.0,
+                (ustime()-start)/1000.0);
+
+    editorSelectSyntaxHighlight(filename);
+#ifdef PLUGINS_ENABLED
+    editorLazyFile(filename);
+#endif
+    uint64_t rows_start = ustime();
+    editorOpenLoaded(&fl);
+    editorTrace("%d rows created in %.3f ms, ready after %.3f ms", E.numrows,
+                (ustime()-rows_start)/1000.0, (ustime()-start)/1000.0);
+    if (bench) return editorBenchmark(bench);
+    if (E.batch) {
+        atexit(editorAtExit);
+        return editorBatch(script,keys);
+    }
     enableRawMode(STDIN_FILENO);
     editorSetStatusMessage(
         "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");